@@ -120,16 +120,24 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown carries a batch of up to TLBSHOOTDOWN_BATCH pages; the
+ * target drops its entry for each vaddr if it still maps that paddr,
+ * then counts itself done in the sender's tlbshootdown_wait. A batch
+ * of zero pages means flush the whole TLB if it holds ts_asid. A vaddr
+ * of TLBSHOOTDOWN_ANYVADDR drops every entry for the paddr, for pages
+ * of the vnode page cache that other processes map at other addresses.
  */
+#define TLBSHOOTDOWN_BATCH 8
+#define TLBSHOOTDOWN_ANYVADDR ((vaddr_t)-1)
+
+struct tlbshootdown_wait;
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	//uint32_t ehi
-	//uint32_t elo;
-	int ts_placeholder;
+	unsigned ts_count;
+	vaddr_t ts_vaddr[TLBSHOOTDOWN_BATCH];
+	paddr_t ts_paddr[TLBSHOOTDOWN_BATCH];
+	unsigned ts_asid;
+	struct tlbshootdown_wait *ts_wait;
 };
 
 struct coremap_entry {
@@ -140,9 +148,34 @@ struct coremap_entry {
 	//struct lock *lk;
 	bool recently_used;
 	//bool currently_swapping;
+
+	/* Replacement state; see clock_pick */
+	struct addrspace *owner;	/* charged for this frame, or NULL */
+	unsigned last_ref;		/* vm_ticks when last seen referenced */
+
+	/* CPUs that may have this frame in their TLB, bit N for cpu N */
+	uint32_t tlb_cpus;
+
+	/* Buddy allocator state; see getppages */
+	int order;		/* block order if first page of a free block, else -1 */
+	int next_free;		/* free list links, coremap indexes */
+	int prev_free;
 };
 
-#define TLBSHOOTDOWN_MAX 16
+/*
+ * Largest block the buddy allocator tracks, as a power of two pages
+ * (2^12 pages = 16M). Free memory beyond that is kept as several
+ * top-order blocks.
+ */
+#define BUDDY_MAX_ORDER 12
+
+void buddy_bootstrap(int firstpage);
+
+/*
+ * A sender waits for its shootdown to finish before sending another,
+ * so each CPU can have at most one pending from every other CPU.
+ */
+#define TLBSHOOTDOWN_MAX 32
 
 
 #endif /* _MIPS_VM_H_ */
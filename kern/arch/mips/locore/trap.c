@@ -124,9 +124,8 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
           //      	sys_close(i, &temp);
         //	}
 	//}
-	curproc->exit_status  = true;
-  	curproc->exit_code = _MKWAIT_SIG(sig);
-	V(curproc->sem);
+	vfork_release();
+	proc_exit(_MKWAIT_SIG(sig));
 	//kprintf("got here again\n");
     	thread_exit();
 //	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
@@ -211,6 +210,17 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		if (!iskern && curproc != NULL && curproc->p_exiting) {
+			/*
+			 * Another thread is exiting or execing the
+			 * process. Get interrupts back on, as below
+			 * for a trap, so we can leave at done.
+			 */
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
 		goto done2;
 	}
 
@@ -331,6 +341,11 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (!iskern) {
+		/* Going back to user mode; see if we should exit instead. */
+		proc_checkexit();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
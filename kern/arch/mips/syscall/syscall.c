@@ -159,6 +159,15 @@ syscall(struct trapframe *tf)
 		err = sys_fork(&retval, tf);
 		break;
 
+	    case SYS_vfork:
+		err = sys_vfork(&retval, tf);
+		break;
+
+	    case SYS_spawn:
+		err = sys_spawn((const_userptr_t)tf->tf_a0,
+				(const_userptr_t)tf->tf_a1, &retval);
+		break;
+
 	    case SYS_getpid:
 		err = sys_getpid(&retval);
 		break;
@@ -179,6 +188,56 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
 		break;
 
+	    case SYS_mmap:
+		/* fd is the fifth argument, offset the sixth (aligned). */
+		err = copyin((const_userptr_t)tf->tf_sp+16, &whence, sizeof(int));
+		if (err) {
+			break;
+		}
+		err = copyin((const_userptr_t)tf->tf_sp+24, &pos, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((void *)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			       tf->tf_a3, whence, pos, &retval);
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((void *)tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
+	    case SYS_msync:
+		err = sys_msync((void *)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				&retval);
+		break;
+
+	    case SYS___vmstat:
+		err = sys_vmstat((userptr_t)tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
+	    case SYS___thread_create:
+		err = sys_thread_create((userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1,
+					(userptr_t)tf->tf_a2, tf, &retval);
+		break;
+
+	    case SYS_thread_exit:
+		sys_thread_exit(tf->tf_a0);
+		break;
+
+	    case SYS_thread_join:
+		err = sys_thread_join(tf->tf_a0, (userptr_t)tf->tf_a1,
+				      &retval);
+		break;
+
+	    case SYS_futex_wait:
+		err = sys_futex_wait((userptr_t)tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
+	    case SYS_futex_wake:
+		err = sys_futex_wake((userptr_t)tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -235,3 +294,19 @@ enter_forked_process(void *val, unsigned long as)
 	kfree(child_tf);
 	mips_usermode(&temp);
 }
+
+/*
+ * Enter user mode for a new thread in an existing process. TF is set
+ * up by sys_thread_create and is on the heap, so copy it to our stack
+ * first; mips_usermode needs it there.
+ */
+void
+enter_new_thread(struct trapframe *tf)
+{
+	struct trapframe temp = *tf;
+
+	kfree(tf);
+	as_activate();
+	mips_usermode(&temp);
+	panic("enter_new_thread: mips_usermode returned\n");
+}
@@ -2,6 +2,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <spl.h>
+#include <membar.h>
 #include <cpu.h>
 #include <spinlock.h>
 #include <proc.h>
@@ -14,16 +15,22 @@
 #include <proc_syscall.h>
 #include <kern/fcntl.h>
 #include <kern/stat.h>
+#include <kern/vmstat.h>
 #include <vfs.h>
 #include <vnode.h>
 #include <bitmap.h>
+#include <clock.h>
+#include <thread.h>
+#include <wchan.h>
+#include <platform/maxcpus.h>
+#include <kmem.h>
 
 #define KERNELPAGE 1
 #define USERPAGE 2
+#define CACHEDPAGE 4
 
 struct coremap_entry *coremap;
 int total_coremap_entries;
-struct lock *proc_table_lock;
 int bytes_used;
 struct bitmap *disk;
 bool swapping_enabled;
@@ -31,9 +38,46 @@ struct vnode *disk_vnode;
 int page_to_evict;
 int start_point;
 struct lock *bitmap_lock;
+static unsigned swap_nslots;
+static unsigned swap_rotor;
+
+/* Most pages moved to or from swap in one request. */
+#define SWAP_CLUSTER 8
 
 //static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 
+static void pageout_poke(void);
+static void pageout_bootstrap(void);
+static int block_io(paddr_t *frames, unsigned npages, off_t place_on_disk,
+                    enum uio_rw rw);
+static void vm_shootdown(const vaddr_t *vaddrs, const paddr_t *paddrs,
+                         unsigned n);
+static vaddr_t pte_shootdown_vaddr(struct page_table_entry *pte,
+                                   vaddr_t vaddr);
+static void tlb_flush_local(void);
+static void zero_bootstrap(void);
+static void tlb_slots_freed(void);
+static uint32_t pte_tlblo(struct page_table_entry *pte, struct region *r);
+
+/*
+ * Event counters for vmstat, one set per CPU. Only the event fields
+ * of each struct vmstat are used. A CPU only adds to its own set, at
+ * splhigh, so counting takes no lock; vm_getstats sums them. Before
+ * the CPU structures exist everything goes to CPU 0's set.
+ */
+static struct vmstat vmstat_cpu[MAXCPUS];
+static unsigned vmstat_free_min = ~0U;
+
+#define VMSTAT_ADD(field, n) do {				\
+        if(CURCPU_EXISTS()){					\
+            int vmstat_spl = splhigh();				\
+            vmstat_cpu[curcpu->c_number].field += (n);		\
+            splx(vmstat_spl);					\
+        } else {						\
+            vmstat_cpu[0].field += (n);				\
+        }							\
+    } while(0)
+
 void
 vm_bootstrap(void)
 {
@@ -42,7 +86,9 @@ vm_bootstrap(void)
     struct stat disk_stat;
 //    char *disk_name;
     spinlock_init(&coremap_spinlock);
-    proc_table_lock = lock_create("proc_table_lock");
+    pte_lock_bootstrap();
+    vpage_bootstrap();
+    zero_bootstrap();
     bitmap_lock = lock_create("bit_map_lock");
     
 //    disk_stat = kmalloc(sizeof(struct stat));
@@ -64,329 +110,2310 @@ vm_bootstrap(void)
         return;
     }
     
-    disk = bitmap_create(disk_stat.st_size/PAGE_SIZE);
+    swap_nslots = disk_stat.st_size/PAGE_SIZE;
+    disk = bitmap_create(swap_nslots);
     
     swapping_enabled = true;
+    pageout_bootstrap();
     
 }
 
-//static
-paddr_t
-getppages(unsigned long npages, int status, struct page_table_entry *pte)
+/*
+ * Buddy allocator over the coremap.
+ *
+ * Free physical pages are kept in blocks of 2^order pages aligned to
+ * their size, one doubly linked free list per order, linked through
+ * the coremap entry of each block's first page. coremap[i].order is
+ * the block's order for the first page of a free block and -1 for
+ * every other page. All of this is protected by coremap_spinlock.
+ */
+static int buddy_free[BUDDY_MAX_ORDER + 1];
+static unsigned buddy_npages_free;
+
+static
+void
+buddy_push(int index, int order)
 {
-    int result;
-    uint32_t ehi, elo;
-    spinlock_acquire(&coremap_spinlock);
-    bool found_pages = false;
-    for(int i = 0; i<total_coremap_entries; i++){
-        if(!coremap[i].page_status){
-            found_pages = true;
-            for(int j = i; j < (int)(i + npages); j++){
-                if(coremap[j].page_status != 0){
-                    i = j;
-                    found_pages = false;
-                    break;
-                }
-                if(j == (int)npages){
-                    break;
-                }
-                if(j >= total_coremap_entries){
-                    spinlock_release(&coremap_spinlock);
-                    return 0;
-                }
-            }
-            if(found_pages){
-                for(int temp = i; temp < (int)(i +npages); temp++){
-                    coremap[temp].page_status = status;
-                }
-                coremap[i].chunk_size = npages;
-                coremap[i].pte = pte;
-                bytes_used += (npages * PAGE_SIZE);
-                paddr_t retval1 = i * PAGE_SIZE;
-                bzero((void *)PADDR_TO_KVADDR(retval1), npages * PAGE_SIZE);
-                spinlock_release(&coremap_spinlock);
-                return (i * PAGE_SIZE);
-            }
-        }
+    buddy_npages_free += 1 << order;
+    coremap[index].order = order;
+    coremap[index].prev_free = -1;
+    coremap[index].next_free = buddy_free[order];
+    if(buddy_free[order] >= 0){
+        coremap[buddy_free[order]].prev_free = index;
     }
-    if(swapping_enabled){
-        page_to_evict++;
-        while(coremap[page_to_evict].page_status != USERPAGE || (coremap[page_to_evict].recently_used == true && coremap[page_to_evict].page_status == USERPAGE)){
-            //while(coremap[page_to_evict].page_status != USERPAGE ){
-            coremap[page_to_evict].recently_used = false;
-            if(page_to_evict > total_coremap_entries-1){
-                page_to_evict = start_point;
-            }
-            page_to_evict++;
+    buddy_free[order] = index;
+}
+
+static
+void
+buddy_unlink(int index, int order)
+{
+    if(coremap[index].prev_free >= 0){
+        coremap[coremap[index].prev_free].next_free = coremap[index].next_free;
+    } else {
+        buddy_free[order] = coremap[index].next_free;
+    }
+    if(coremap[index].next_free >= 0){
+        coremap[coremap[index].next_free].prev_free = coremap[index].prev_free;
+    }
+    buddy_npages_free -= 1 << order;
+    coremap[index].order = -1;
+}
+
+/*
+ * Free one aligned block, merging it with its buddy for as long as
+ * the buddy is itself a whole free block of the same order.
+ */
+static
+void
+buddy_free_block(int index, int order)
+{
+    while(order < BUDDY_MAX_ORDER){
+        int buddy = index ^ (1 << order);
+        if(buddy + (1 << order) > total_coremap_entries ||
+           coremap[buddy].page_status != 0 ||
+           coremap[buddy].order != order){
+            break;
         }
-        KASSERT(coremap[page_to_evict].page_status == USERPAGE);
-        KASSERT(coremap[page_to_evict].pte != NULL);
-        int retval = page_to_evict;
-        
-        coremap[retval].recently_used = true;
-        
-        struct page_table_entry *old_pte = coremap[retval].pte;
-        coremap[retval].pte = pte;
-        coremap[retval].page_status = status;
-        spinlock_release(&coremap_spinlock);
-        
-        lock_acquire(bitmap_lock);
-        unsigned int place_on_disk = 0;
-        result = bitmap_alloc(disk,&place_on_disk);
-        if (result) {
-            lock_release(bitmap_lock);
-            return result;
+        buddy_unlink(buddy, order);
+        if(buddy < index){
+            index = buddy;
         }
-        lock_release(bitmap_lock);
-        
-        lock_acquire(old_pte->lk);
-        struct page_table_entry *current_page_table;
-        current_page_table = old_pte;
-        current_page_table->offset = place_on_disk*PAGE_SIZE;
-        current_page_table->state = true;
-        KASSERT(bitmap_isset(disk, place_on_disk) != 0);
-        block_write(retval*PAGE_SIZE, place_on_disk*PAGE_SIZE);
-        
-        ehi = old_pte->vpn;
-        elo = old_pte->ppn | TLBLO_DIRTY | TLBLO_VALID;
-        int i = tlb_probe(ehi, elo);
-        if(i < 0){
-            
-        } else {
-            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        order++;
+    }
+    buddy_push(index, order);
+}
+
+/*
+ * Free an arbitrary run of pages by splitting it into the largest
+ * aligned blocks it contains.
+ */
+static
+void
+buddy_free_run(int index, int npages)
+{
+    while(npages > 0){
+        int order = 0;
+        while(order < BUDDY_MAX_ORDER &&
+              (index & ((1 << (order + 1)) - 1)) == 0 &&
+              (1 << (order + 1)) <= npages){
+            order++;
         }
-        
-        lock_release(old_pte->lk);
-        bzero((void *)PADDR_TO_KVADDR(retval*PAGE_SIZE), PAGE_SIZE);
-        return (retval*PAGE_SIZE);
-    } else {
-        spinlock_release(&coremap_spinlock);
-        return 0;
+        buddy_free_block(index, order);
+        index += 1 << order;
+        npages -= 1 << order;
     }
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(unsigned npages)
+/*
+ * Take NPAGES contiguous pages off the free lists. The smallest block
+ * that fits is split down; the unused tail of a block bigger than
+ * NPAGES goes straight back. Returns the first page index or -1.
+ */
+static
+int
+buddy_alloc(int npages)
 {
-    paddr_t pa;
-    //    spinlock_acquire(&coremap_spinlock);
-    pa = getppages(npages,1, NULL);
-    //    spinlock_release(&coremap_spinlock);
-    if (pa==0) {
-        return 0;
+    int order = 0;
+    int k;
+    int index;
+    
+    while((1 << order) < npages){
+        order++;
     }
-    return PADDR_TO_KVADDR(pa);
+    if(order > BUDDY_MAX_ORDER){
+        return -1;
+    }
+    for(k = order; k <= BUDDY_MAX_ORDER; k++){
+        if(buddy_free[k] >= 0){
+            break;
+        }
+    }
+    if(k > BUDDY_MAX_ORDER){
+        return -1;
+    }
+    index = buddy_free[k];
+    buddy_unlink(index, k);
+    while(k > order){
+        k--;
+        buddy_push(index + (1 << k), k);
+    }
+    for(int i = index; i < index + npages; i++){
+        coremap[i].order = -1;
+    }
+    if((1 << order) > npages){
+        buddy_free_run(index + npages, (1 << order) - npages);
+    }
+    return index;
 }
 
+/*
+ * Called from ram_bootstrap once the coremap is set up: everything
+ * from FIRSTPAGE to the end of RAM starts out free.
+ */
 void
-free_kpages(vaddr_t addr)
+buddy_bootstrap(int firstpage)
 {
-    spinlock_acquire(&coremap_spinlock);
-    int start_point = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
-    int chunk = coremap[start_point].chunk_size;
-    bytes_used -= (chunk * PAGE_SIZE);
-    for(int i = start_point; i < start_point + chunk; i++){
-        coremap[i].chunk_size = 0;
+    for(int i = 0; i <= BUDDY_MAX_ORDER; i++){
+        buddy_free[i] = -1;
+    }
+    for(int i = 0; i < total_coremap_entries; i++){
+        coremap[i].order = -1;
+        coremap[i].next_free = -1;
+        coremap[i].prev_free = -1;
+    }
+    buddy_free_run(firstpage, total_coremap_entries - firstpage);
+}
+
+/*
+ * Per-CPU caches of free frames.
+ *
+ * Single-page allocations and frees go through the current CPU's
+ * cache with interrupts off, and only take coremap_spinlock to move
+ * PAGECACHE_BATCH frames at a time between the cache and the buddy
+ * lists. Cached frames are marked CACHEDPAGE so the eviction clock
+ * and the buddy allocator leave them alone. They are counted in
+ * bytes_used, since they are off the buddy lists, and subtracted
+ * again in coremap_used_bytes.
+ */
+#define PAGECACHE_SIZE 16
+#define PAGECACHE_BATCH 8
+
+static struct {
+    unsigned count;
+    int pages[PAGECACHE_SIZE];
+} pagecache[MAXCPUS];
+
+
+/* Give N frames from CPUNUM's cache back to the buddy lists. Call with coremap_spinlock held. */
+static
+void
+pagecache_drain(unsigned cpunum, unsigned n)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+    while(n > 0 && pagecache[cpunum].count > 0){
+        int i = pagecache[cpunum].pages[--pagecache[cpunum].count];
+        KASSERT(coremap[i].page_status == CACHEDPAGE);
         coremap[i].page_status = 0;
+        bytes_used -= PAGE_SIZE;
+        buddy_free_run(i, 1);
+        n--;
     }
-    spinlock_release(&coremap_spinlock);
-    
 }
 
-unsigned
+/* Take one frame from this CPU's cache, refilling it if empty. Returns -1 if none. */
+static
 int
-coremap_used_bytes() {
+pagecache_get(void)
+{
+    unsigned cpunum;
+    int i = -1;
+    int spl;
+    
+    if(!CURCPU_EXISTS()){
+        return -1;
+    }
+    
+    spl = splhigh();
+    cpunum = curcpu->c_number;
+    if(pagecache[cpunum].count == 0){
+        spinlock_acquire(&coremap_spinlock);
+        while(pagecache[cpunum].count < PAGECACHE_BATCH){
+            int page = buddy_alloc(1);
+            if(page < 0){
+                break;
+            }
+            coremap[page].page_status = CACHEDPAGE;
+            bytes_used += PAGE_SIZE;
+            pagecache[cpunum].pages[pagecache[cpunum].count++] = page;
+        }
+        pageout_poke();
+        spinlock_release(&coremap_spinlock);
+    }
+    if(pagecache[cpunum].count > 0){
+        i = pagecache[cpunum].pages[--pagecache[cpunum].count];
+    }
+    splx(spl);
+    return i;
+}
+
+/* Put one frame in this CPU's cache, draining it first if full. */
+static
+bool
+pagecache_put(int i)
+{
+    unsigned cpunum;
+    int spl;
     
-    return bytes_used;
+    if(!CURCPU_EXISTS()){
+        return false;
+    }
+    
+    spl = splhigh();
+    cpunum = curcpu->c_number;
+    if(pagecache[cpunum].count == PAGECACHE_SIZE){
+        spinlock_acquire(&coremap_spinlock);
+        pagecache_drain(cpunum, PAGECACHE_BATCH);
+        spinlock_release(&coremap_spinlock);
+    }
+    coremap[i].chunk_size = 0;
+    coremap[i].pte = NULL;
+    coremap[i].recently_used = false;
+    coremap[i].page_status = CACHEDPAGE;
+    pagecache[cpunum].pages[pagecache[cpunum].count++] = i;
+    splx(spl);
+    return true;
 }
 
+/*
+ * Pageout daemon.
+ *
+ * Eviction runs in its own kernel thread, which sleeps on
+ * pageout_wchan until the number of free frames on the buddy lists
+ * drops below pageout_low and then evicts until it is back above
+ * pageout_high. Allocations normally find a frame already free. One
+ * that doesn't sleeps on frame_wchan until the daemon frees a frame
+ * or finishes a pass without freeing anything; vm_pageout_stats
+ * counts how often that happens. Both wait channels use
+ * coremap_spinlock.
+ */
+static struct thread *pageout_thread;
+static struct wchan *pageout_wchan;
+static struct wchan *frame_wchan;
+static unsigned pageout_low;
+static unsigned pageout_high;
+static unsigned pageout_waiters;
+static unsigned pageout_passes;
+static unsigned pageout_lastfreed;
+
+static struct pageout_stats {
+    unsigned long wakeups;		/* daemon passes */
+    unsigned long evictions;		/* pages evicted by the daemon */
+    unsigned long direct_evictions;	/* pages evicted by the allocating thread */
+    unsigned long clean_evictions;	/* evictions that needed no swap write */
+    unsigned long swap_writes;		/* VOP_WRITEs issued to swap */
+    unsigned long pages_written;	/* pages those writes carried */
+    unsigned long swap_reads;		/* VOP_READs issued to swap */
+    unsigned long pages_read;		/* pages those reads carried */
+    unsigned long file_reads;		/* pages read from executables and mmap */
+    unsigned long text_shared;		/* faults served from the vnode page cache */
+    unsigned long file_writes;		/* MAP_SHARED pages written back */
+    unsigned long blocked;		/* allocations that had to wait */
+    unsigned long shootdowns;		/* batches that needed an IPI */
+    unsigned long zero_maps;		/* read faults given the zero page */
+    unsigned long prezeroed;		/* frames taken already zeroed */
+} vm_pageout_stats;
+
+/* Wake the daemon if free memory is low. Call with coremap_spinlock held. */
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+pageout_poke(void)
 {
-    (void)ts;
+    if(pageout_thread != NULL && buddy_npages_free < pageout_low){
+        wchan_wakeone(pageout_wchan, &coremap_spinlock);
+    }
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+/*
+ * Page replacement is WSClock over the coremap.
+ *
+ * TLB hits never fault, so reference bits are sampled: every few
+ * hardclocks vm_tlb_sample marks the frames of all valid TLB entries
+ * on that CPU as recently used and then invalidates them, so whatever
+ * is in the TLB at the next sample was touched in between. CPU 0
+ * advances vm_ticks at each sample, and the clock hand stamps
+ * last_ref with it when it finds the bit set.
+ *
+ * A page is outside the working set once it hasn't been referenced
+ * for WS_TAU samples. The first sweep only takes such pages that are
+ * clean (they are dropped without a swap write), remembering the first
+ * dirty one in case there are none. Pages of an address space with
+ * no more than VM_RESIDENT_FLOOR resident pages are left alone unless
+ * nothing else can be found, so one large process can't push every
+ * other process out of memory.
+ */
+#define WS_TAU			4	/* samples, about a third of a second */
+#define VM_RESIDENT_FLOOR	16	/* pages */
+
+static volatile unsigned vm_ticks;
+
+void
+vm_tlb_sample(void)
 {
-    bool vaddr_in_segment = false;
-    bool vaddr_in_page_table = false;
-    struct addrspace *as;
-    paddr_t paddr = 0;
     uint32_t ehi, elo;
+    unsigned pfn;
     int spl;
-    //    struct uio u;
-    //    struct iovec iov;
     
-    faultaddress &= PAGE_FRAME;
+    spl = splhigh();
+    for(int i = 0; i < NUM_TLB; i++){
+        tlb_read(&ehi, &elo, i);
+        if(!(elo & TLBLO_VALID)){
+            continue;
+        }
+        pfn = (elo & TLBLO_PPAGE) / PAGE_SIZE;
+        if(pfn < (unsigned)total_coremap_entries){
+            coremap[pfn].recently_used = true;
+        }
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_slots_freed();
+    splx(spl);
     
-    switch (faulttype) {
-        case VM_FAULT_READONLY:
-        case VM_FAULT_READ:
-        case VM_FAULT_WRITE:
-            break;
-        default:
-            return EINVAL;
+    if(curcpu->c_number == 0){
+        vm_ticks++;
     }
+}
+
+/*
+ * Charge a user frame to the address space that faulted it in, for
+ * the resident-set floor.
+ */
+static
+void
+vm_set_owner(paddr_t pa, struct addrspace *as)
+{
+    int i = pa / PAGE_SIZE;
     
-    if (curproc == NULL) {
-        return EFAULT;
+    spinlock_acquire(&coremap_spinlock);
+    KASSERT(coremap[i].owner == NULL);
+    coremap[i].owner = as;
+    coremap[i].last_ref = vm_ticks;
+    as->as_resident++;
+    spinlock_release(&coremap_spinlock);
+}
+
+/* Call with coremap_spinlock held. */
+static
+void
+vm_clear_owner(int i)
+{
+    if(coremap[i].owner != NULL){
+        coremap[i].owner->as_resident--;
+        coremap[i].owner = NULL;
+    }
+}
+
+/*
+ * Forget `as' as the owner of any frames before it goes away. Frames
+ * it still shares copy-on-write stay resident but aren't charged to
+ * anyone.
+ */
+void
+vm_disown(struct addrspace *as)
+{
+    spinlock_acquire(&coremap_spinlock);
+    for(int i = 0; i < total_coremap_entries && as->as_resident > 0; i++){
+        if(coremap[i].owner == as){
+            vm_clear_owner(i);
+        }
     }
+    spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * Advance the hand and return the index of a resident user page to
+ * evict, or -1 if there is none. Call with coremap_spinlock held.
+ *
+ * Pass 0 wants an old, clean page above the floor, settling for the
+ * first old dirty one. Pass 1 takes anything not referenced since the
+ * hand last went by, still respecting the floor; pass 2 ignores it.
+ */
+static
+int
+clock_pick(void)
+{
+    int dirty = -1;
+    struct coremap_entry *e;
+    struct page_table_entry *pte;
     
-    as = proc_getas();
+    for(int pass = 0; pass < 3; pass++){
+        for(int n = 0; n < total_coremap_entries; n++){
+            VMSTAT_ADD(vs_scans, 1);
+            page_to_evict++;
+            if(page_to_evict >= total_coremap_entries){
+                page_to_evict = 0;
+            }
+            e = &coremap[page_to_evict];
+            if(e->page_status != USERPAGE){
+                continue;
+            }
+            KASSERT(e->pte != NULL);
+            if(e->recently_used){
+                e->recently_used = false;
+                e->last_ref = vm_ticks;
+                continue;
+            }
+            if(pass < 2 && e->owner != NULL &&
+               e->owner->as_resident <= VM_RESIDENT_FLOOR){
+                continue;
+            }
+            if(pass > 0){
+                return page_to_evict;
+            }
+            if(vm_ticks - e->last_ref <= WS_TAU){
+                continue;
+            }
+            /* Unlocked peek; at worst we write a page we thought dirty. */
+            pte = e->pte;
+            if(pte->dirty){
+                if(dirty < 0){
+                    dirty = page_to_evict;
+                }
+                continue;
+            }
+            return page_to_evict;
+        }
+        if(dirty >= 0){
+            return dirty;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Find up to `want' free swap slots in a row, searching from the rotor,
+ * and mark them. Settles for the longest shorter run if there is no
+ * run of the full length. Returns the number of slots taken (0 if swap
+ * is full) and the first one in *slotp. Call with bitmap_lock held.
+ */
+static
+unsigned
+swap_alloc_run(unsigned want, unsigned *slotp)
+{
+    unsigned best = 0, beststart = 0;
+    unsigned start, len;
+    unsigned scanned = 0;
     
-    if (as == NULL) {
-        return EFAULT;
+    start = swap_rotor;
+    while(scanned < swap_nslots && best < want){
+        if(start >= swap_nslots){
+            start = 0;
+        }
+        if(bitmap_isset(disk, start)){
+            start++;
+            scanned++;
+            continue;
+        }
+        len = 0;
+        while(len < want && start + len < swap_nslots &&
+              !bitmap_isset(disk, start + len)){
+            len++;
+        }
+        if(len > best){
+            best = len;
+            beststart = start;
+        }
+        start += len;
+        scanned += len;
+    }
+    
+    for(unsigned i = 0; i < best; i++){
+        bitmap_mark(disk, beststart + i);
     }
+    swap_rotor = beststart + best;
+    *slotp = beststart;
+    return best;
+}
+
+/*
+ * Evict up to `max' victim pages and put their frames back on the
+ * buddy lists. Returns the number of frames freed.
+ *
+ * Pages that still match their swap slot or file are dropped without
+ * I/O. The dirty ones are sorted by virtual address and moved into a run
+ * of adjacent slots (giving up any slot they had), then written with
+ * one VOP_WRITE per run, so pages a program touched together can be
+ * read back together by vm_swapin.
+ */
+static
+unsigned
+vm_evict(unsigned max)
+{
+    int victims[SWAP_CLUSTER];
+    struct page_table_entry *ptes[SWAP_CLUSTER];
+    paddr_t frames[SWAP_CLUSTER];
+    vaddr_t vaddrs[SWAP_CLUSTER];
+    bool evicted[SWAP_CLUSTER];
+    unsigned write[SWAP_CLUSTER];
+    unsigned n, nwrite, nclean, i, j, got, slot, freed;
+    int result;
     
+    KASSERT(max <= SWAP_CLUSTER && max <= TLBSHOOTDOWN_BATCH);
     
-    struct region *current_region = as->rbase;
-    while(current_region != NULL){
-        if(faultaddress >= current_region->region_start_address && faultaddress < current_region->region_start_address + current_region->region_size){
-            vaddr_in_segment = true;
+    spinlock_acquire(&coremap_spinlock);
+    for(n = 0; n < max; n++){
+        victims[n] = clock_pick();
+        if(victims[n] < 0){
             break;
-        } else {
-            current_region = current_region->next;
         }
+        ptes[n] = coremap[victims[n]].pte;
+        /* Pin it while we write it out. */
+        coremap[victims[n]].page_status = 3;
+    }
+    spinlock_release(&coremap_spinlock);
+    if(n == 0){
+        return 0;
     }
     
-    if(vaddr_in_segment){
-        struct page_table_entry *current_page_table = as->ptbase;
-        while(current_page_table != NULL){
-            if(faultaddress == current_page_table->vpn){
-                lock_acquire(current_page_table->lk);
-                vaddr_in_page_table = true;
-                paddr = current_page_table->ppn;
-                if(swapping_enabled){
-                    
-                    if(current_page_table->state == true){
-                        
-                        KASSERT(current_page_table->lk != NULL);
-                        paddr_t new_page = getppages(1,3, current_page_table);
-                        block_read(new_page, current_page_table->offset);
-                        off_t temp_off = current_page_table->offset/PAGE_SIZE;
-                        current_page_table->state = false;
-                        paddr = new_page;
-                        current_page_table->ppn = new_page;
-                        spl = splhigh();
-                        ehi = faultaddress;
-                        elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-                        int result = tlb_probe(ehi, elo);
-                        if(result < 0){
-                            tlb_random(ehi, elo);
-                        } else {
-                            tlb_write(ehi, elo, result);
-                        }
-                        splx(spl);
-                        coremap[paddr/PAGE_SIZE].recently_used = true;
-                        coremap[paddr/PAGE_SIZE].page_status = 2;
-                        lock_release(current_page_table->lk);
-                        
-                        lock_acquire(bitmap_lock);
-                        bitmap_unmark(disk, temp_off);
-                        lock_release(bitmap_lock);
-                        
-//                        spinlock_acquire(&coremap_spinlock);
-//                        coremap[paddr/PAGE_SIZE].recently_used = true;
-//                        spinlock_release(&coremap_spinlock);
-                        
-                        return 0;
-                    }
-                }
-                lock_release(current_page_table->lk);
-                break;
+    /* Sort by address; this is also the order we take the PTE locks in. */
+    for(i = 1; i < n; i++){
+        for(j = i; j > 0 && ptes[j-1]->vpn > ptes[j]->vpn; j--){
+            struct page_table_entry *tp = ptes[j];
+            int tv = victims[j];
+            ptes[j] = ptes[j-1];
+            victims[j] = victims[j-1];
+            ptes[j-1] = tp;
+            victims[j-1] = tv;
+        }
+    }
+    
+    for(i = 0; i < n; i++){
+        pte_lock(ptes[i]);
+        KASSERT(ptes[i]->ppn == (paddr_t)victims[i]*PAGE_SIZE);
+        vaddrs[i] = pte_shootdown_vaddr(ptes[i], ptes[i]->vpn);
+        frames[i] = ptes[i]->ppn;
+    }
+    
+    /* Drop the translations first so nobody dirties them behind our back. */
+    vm_shootdown(vaddrs, frames, n);
+    
+    nwrite = nclean = 0;
+    for(i = 0; i < n; i++){
+        evicted[i] = true;
+        if(ptes[i]->refcount == 0){
+            /* Released while we waited for it; nothing worth saving. */
+            continue;
+        }
+        if(ptes[i]->dirty && ptes[i]->vpage != NULL){
+            /* MAP_SHARED page; it goes back to its file, not swap. */
+            if(vpage_writeback(ptes[i])){
+                evicted[i] = false;
             } else {
-                current_page_table = current_page_table->next;
+                ptes[i]->dirty = false;
+                vm_pageout_stats.file_writes++;
             }
+        } else if(ptes[i]->dirty){
+            write[nwrite++] = i;
+        } else {
+            nclean++;
         }
-    } else {
-        return EFAULT;
     }
     
-    if(vaddr_in_page_table){
-//        spinlock_acquire(&coremap_spinlock);
-//        coremap[paddr/PAGE_SIZE].recently_used = true;
-//        spinlock_release(&coremap_spinlock);
-        spl = splhigh();
-        ehi = faultaddress;
-        elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-        int result = tlb_probe(ehi, elo);
-        if(result < 0){
-            tlb_random(ehi, elo);
-        } else {
-            tlb_write(ehi, elo, result);
+    for(i = 0; i < nwrite; i += got){
+        lock_acquire(bitmap_lock);
+        got = swap_alloc_run(nwrite - i, &slot);
+        for(j = 0; j < got; j++){
+            struct page_table_entry *pte = ptes[write[i+j]];
+            if(pte->offset != -1){
+                bitmap_unmark(disk, pte->offset/PAGE_SIZE);
+            }
+            pte->offset = (slot + j) * PAGE_SIZE;
+            frames[j] = pte->ppn;
         }
-        coremap[paddr/PAGE_SIZE].recently_used = true;
-        splx(spl);
-        return 0;
+        lock_release(bitmap_lock);
         
-    } else {
-        struct page_table_entry *new_pte = kmalloc(sizeof(struct page_table_entry));
+        if(got == 0){
+            /* Swap is full; keep the rest in memory. */
+            for(; i < nwrite; i++){
+                evicted[write[i]] = false;
+            }
+            break;
+        }
+        result = block_io(frames, got, (off_t)slot*PAGE_SIZE, UIO_WRITE);
+        for(j = 0; j < got; j++){
+            if(result){
+                evicted[write[i+j]] = false;
+            } else {
+                ptes[write[i+j]]->dirty = false;
+            }
+        }
+        if(!result){
+            vm_pageout_stats.swap_writes++;
+            vm_pageout_stats.pages_written += got;
+        }
+    }
+    
+    for(i = 0; i < n; i++){
+        bool dead = ptes[i]->refcount == 0;
         
-        if(new_pte == NULL){
-            return ENOMEM;
-        }
-        new_pte->vpn = faultaddress;
-        new_pte->lk = lock_create("swapping lock");
-        if(new_pte->lk == NULL){
-            return ENOMEM;
-        }
-        KASSERT(new_pte->lk != NULL);
-        lock_acquire(new_pte->lk);
-        new_pte->ppn = getppages(1,3, new_pte);
-        if(new_pte->ppn == 0){
-            return ENOMEM;
-        }
-        if(new_pte->ppn == 0){
-            kfree(new_pte);
-            return ENOMEM;
-        }
-        new_pte->offset = -1;
-        new_pte->state = false;
-        new_pte->next = as->ptbase;
-        as->ptbase = new_pte;
-        spl = splhigh();
-        ehi = faultaddress;
-        elo = new_pte->ppn | TLBLO_DIRTY | TLBLO_VALID;
-        int result = tlb_probe(ehi, elo);
-        if(result < 0){
-            tlb_random(ehi, elo);
-        } else {
-            tlb_write(ehi, elo, result);
+        if(evicted[i]){
+            ptes[i]->state = true;
+        }
+        pte_unlock(ptes[i]);
+        if(dead){
+            /* pte_release left it to us; see vm_frame_claim. */
+            kmem_cache_free(&pte_cache, ptes[i]);
         }
-        coremap[new_pte->ppn/PAGE_SIZE].recently_used = true;
-        coremap[new_pte->ppn/PAGE_SIZE].page_status = 2;
-        splx(spl);
-        lock_release(new_pte->lk);
-        return 0;
     }
     
-    return 0;
+    freed = 0;
+    spinlock_acquire(&coremap_spinlock);
+    for(i = 0; i < n; i++){
+        int v = victims[i];
+        if(!evicted[i]){
+            coremap[v].page_status = USERPAGE;
+            continue;
+        }
+        vm_clear_owner(v);
+        coremap[v].chunk_size = 0;
+        coremap[v].pte = NULL;
+        coremap[v].recently_used = false;
+        coremap[v].page_status = 0;
+        bytes_used -= PAGE_SIZE;
+        buddy_free_run(v, 1);
+        freed++;
+    }
+    vm_pageout_stats.clean_evictions += nclean;
+    VMSTAT_ADD(vs_evictions, freed);
+    if(freed > 0 && pageout_waiters > 0){
+        wchan_wakeall(frame_wchan, &coremap_spinlock);
+    }
+    spinlock_release(&coremap_spinlock);
+    return freed;
 }
 
-int
-block_write(paddr_t place_on_memory, off_t place_on_disk)
+static
+void
+pageout_daemon(void *data1, unsigned long data2)
 {
-    struct uio u;
-    struct iovec iov;
-    uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(place_on_memory), PAGE_SIZE, place_on_disk, UIO_WRITE);
-    int result = VOP_WRITE(disk_vnode, &u);
-    if (result) {
-        return result;
+    unsigned freed;
+    
+    (void)data1;
+    (void)data2;
+    
+    spinlock_acquire(&coremap_spinlock);
+    pageout_thread = curthread;
+    while(1){
+        while(buddy_npages_free >= pageout_low && pageout_waiters == 0){
+            wchan_sleep(pageout_wchan, &coremap_spinlock);
+        }
+        vm_pageout_stats.wakeups++;
+        freed = 0;
+        while(buddy_npages_free < pageout_high){
+            spinlock_release(&coremap_spinlock);
+            unsigned n = vm_evict(SWAP_CLUSTER);
+            spinlock_acquire(&coremap_spinlock);
+            if(n == 0){
+                break;
+            }
+            freed += n;
+            vm_pageout_stats.evictions += n;
+        }
+        pageout_lastfreed = freed;
+        pageout_passes++;
+        wchan_wakeall(frame_wchan, &coremap_spinlock);
     }
-    return 0;
 }
 
-int
-block_read(paddr_t place_on_memory, off_t place_on_disk)
+/*
+ * Start the daemon. Called from vm_bootstrap once swapping is known
+ * to be available.
+ */
+static
+void
+pageout_bootstrap(void)
 {
-    struct uio u;
-    struct iovec iov;
-    uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(place_on_memory), PAGE_SIZE, place_on_disk, UIO_READ);
-    int result = VOP_READ(disk_vnode, &u);
-    if(result){
+    int result;
+    
+    pageout_wchan = wchan_create("pageout");
+    frame_wchan = wchan_create("pageout_frame");
+    if(pageout_wchan == NULL || frame_wchan == NULL){
+        panic("pageout_bootstrap: out of memory\n");
+    }
+    
+    spinlock_acquire(&coremap_spinlock);
+    pageout_low = buddy_npages_free / 32;
+    if(pageout_low < 8){
+        pageout_low = 8;
+    }
+    pageout_high = pageout_low * 2;
+    spinlock_release(&coremap_spinlock);
+    
+    result = thread_fork("pageout", NULL, pageout_daemon, NULL, 0);
+    if(result){
+        panic("pageout_bootstrap: thread_fork: %s\n", strerror(result));
+    }
+}
+
+/*
+ * Pre-zeroed frames.
+ *
+ * Idle CPUs zero free frames ahead of time (vm_prezero is called
+ * from the idle loop in thread_switch) and park them here, so faults
+ * on fresh pages don't pay for the bzero. Like the per-CPU caches,
+ * parked frames are CACHEDPAGE and counted in bytes_used. The pool
+ * only fills while free memory is above pageout_high, and is used up
+ * before anything gets evicted.
+ */
+#define PREZERO_MAX 64
+
+static int prezero_pages[PREZERO_MAX];
+static unsigned prezero_count;
+static unsigned prezero_target;		/* 0 until vm_bootstrap */
+
+/* Take a zeroed frame from the pool, or -1. Call with coremap_spinlock held. */
+static
+int
+prezero_take(void)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+    if(prezero_count == 0){
+        return -1;
+    }
+    vm_pageout_stats.prezeroed++;
+    return prezero_pages[--prezero_count];
+}
+
+/*
+ * Zero one free frame into the pool. Returns false if the pool is
+ * full or memory is short, in which case the caller should really go
+ * idle.
+ */
+bool
+vm_prezero(void)
+{
+    int i;
+    
+    if(prezero_target == 0){
+        return false;
+    }
+    
+    spinlock_acquire(&coremap_spinlock);
+    if(prezero_count >= prezero_target ||
+       buddy_npages_free <= pageout_high){
+        spinlock_release(&coremap_spinlock);
+        return false;
+    }
+    i = buddy_alloc(1);
+    if(i < 0){
+        spinlock_release(&coremap_spinlock);
+        return false;
+    }
+    coremap[i].page_status = CACHEDPAGE;
+    bytes_used += PAGE_SIZE;
+    spinlock_release(&coremap_spinlock);
+    
+    bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), PAGE_SIZE);
+    
+    spinlock_acquire(&coremap_spinlock);
+    if(prezero_count < PREZERO_MAX){
+        prezero_pages[prezero_count++] = i;
+    } else {
+        /* Other idle CPUs filled it in the meantime. */
+        coremap[i].page_status = 0;
+        bytes_used -= PAGE_SIZE;
+        buddy_free_run(i, 1);
+    }
+    spinlock_release(&coremap_spinlock);
+    return true;
+}
+
+/*
+ * Get a single frame when the free lists are empty. Waits for the
+ * daemon if we're allowed to sleep; otherwise (or if we are the
+ * daemon) evicts directly. Called and returns with coremap_spinlock
+ * held. Returns a coremap index or -1.
+ */
+static
+int
+getppages_slow(void)
+{
+    int i;
+    bool tried = false;
+    
+    if(!swapping_enabled || curthread->t_in_interrupt ||
+       curcpu->c_spinlocks != 1){
+        return -1;
+    }
+    
+    if(pageout_thread == NULL || curthread == pageout_thread){
+        spinlock_release(&coremap_spinlock);
+        unsigned n = vm_evict(SWAP_CLUSTER);
+        spinlock_acquire(&coremap_spinlock);
+        if(n == 0){
+            return -1;
+        }
+        vm_pageout_stats.direct_evictions += n;
+        return buddy_alloc(1);
+    }
+    
+    vm_pageout_stats.blocked++;
+    while((i = buddy_alloc(1)) < 0){
+        if(tried && pageout_lastfreed == 0){
+            return -1;
+        }
+        unsigned pass = pageout_passes;
+        pageout_waiters++;
+        wchan_wakeone(pageout_wchan, &coremap_spinlock);
+        while(pageout_passes == pass && buddy_npages_free == 0){
+            wchan_sleep(frame_wchan, &coremap_spinlock);
+        }
+        pageout_waiters--;
+        tried = true;
+    }
+    return i;
+}
+
+/*
+ * Allocate NPAGES contiguous frames, zeroed if ZERO is set. Single
+ * zeroed frames come from the pre-zeroed pool when it has any. The
+ * VM itself passes false for frames it is about to overwrite whole.
+ */
+static
+paddr_t
+getppages_zero(unsigned long npages, int status, struct page_table_entry *pte,
+               bool zero)
+{
+    int i;
+    
+    if(npages == 1){
+        i = -1;
+        if(zero && prezero_count > 0){
+            spinlock_acquire(&coremap_spinlock);
+            i = prezero_take();
+            spinlock_release(&coremap_spinlock);
+            if(i >= 0){
+                zero = false;
+            }
+        }
+        if(i < 0){
+            i = pagecache_get();
+        }
+        if(i >= 0){
+            coremap[i].chunk_size = 1;
+            coremap[i].pte = pte;
+            coremap[i].page_status = status;
+            if(zero){
+                bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), PAGE_SIZE);
+            }
+            VMSTAT_ADD(vs_page_allocs, 1);
+            return (i * PAGE_SIZE);
+        }
+    }
+    
+    spinlock_acquire(&coremap_spinlock);
+    i = buddy_alloc(npages);
+    if(i < 0 && npages > 1 && CURCPU_EXISTS()){
+        /* Our own cache may be what's fragmenting the free lists. */
+        pagecache_drain(curcpu->c_number, PAGECACHE_SIZE);
+        i = buddy_alloc(npages);
+    }
+    if(i < 0 && npages == 1){
+        /* Zeroed frames are free memory too; already in bytes_used. */
+        i = prezero_take();
+        if(i >= 0){
+            bytes_used -= PAGE_SIZE;
+            zero = false;
+        }
+    }
+    if(i < 0 && npages == 1){
+        /* Eviction only ever frees single pages. */
+        i = getppages_slow();
+    }
+    if(i < 0){
+        spinlock_release(&coremap_spinlock);
+        return 0;
+    }
+    for(int temp = i; temp < (int)(i +npages); temp++){
+        coremap[temp].page_status = status;
+    }
+    coremap[i].chunk_size = npages;
+    coremap[i].pte = pte;
+    bytes_used += (npages * PAGE_SIZE);
+    if(buddy_npages_free < vmstat_free_min){
+        vmstat_free_min = buddy_npages_free;
+    }
+    pageout_poke();
+    spinlock_release(&coremap_spinlock);
+    VMSTAT_ADD(vs_page_allocs, npages);
+    if(zero){
+        bzero((void *)PADDR_TO_KVADDR(i * PAGE_SIZE), npages * PAGE_SIZE);
+    }
+    return (i * PAGE_SIZE);
+}
+
+paddr_t
+getppages(unsigned long npages, int status, struct page_table_entry *pte)
+{
+    return getppages_zero(npages, status, pte, true);
+}
+
+/*
+ * The shared zero page. A first read of anonymous memory maps this
+ * one read-only frame instead of allocating; the first write breaks
+ * the sharing like any other copy-on-write page. zero_pte keeps a
+ * reference of its own so it is never freed, and its frame is a
+ * kernel page so it is never evicted.
+ */
+static struct page_table_entry *zero_pte;
+
+static
+void
+zero_bootstrap(void)
+{
+    zero_pte = kmem_cache_alloc(&pte_cache);
+    if(zero_pte == NULL){
+        panic("zero_bootstrap: out of memory\n");
+    }
+    zero_pte->ppn = getppages(1, KERNELPAGE, NULL);
+    if(zero_pte->ppn == 0){
+        panic("zero_bootstrap: out of memory\n");
+    }
+    zero_pte->vpn = 0;
+    zero_pte->state = false;
+    zero_pte->dirty = false;
+    zero_pte->offset = -1;
+    zero_pte->refcount = 1;
+    zero_pte->vpage = NULL;
+    
+    spinlock_acquire(&coremap_spinlock);
+    prezero_target = buddy_npages_free / 64;
+    if(prezero_target < 4){
+        prezero_target = 4;
+    } else if(prezero_target > PREZERO_MAX){
+        prezero_target = PREZERO_MAX;
+    }
+    spinlock_release(&coremap_spinlock);
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+    paddr_t pa;
+    //    spinlock_acquire(&coremap_spinlock);
+    pa = getppages(npages,1, NULL);
+    //    spinlock_release(&coremap_spinlock);
+    if (pa==0) {
+        return 0;
+    }
+    return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+    int start_point = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+    if(coremap[start_point].owner != NULL){
+        spinlock_acquire(&coremap_spinlock);
+        vm_clear_owner(start_point);
+        spinlock_release(&coremap_spinlock);
+    }
+    if(coremap[start_point].chunk_size == 1 && pagecache_put(start_point)){
+        return;
+    }
+    spinlock_acquire(&coremap_spinlock);
+    int chunk = coremap[start_point].chunk_size;
+    bytes_used -= (chunk * PAGE_SIZE);
+    for(int i = start_point; i < start_point + chunk; i++){
+        coremap[i].chunk_size = 0;
+        coremap[i].page_status = 0;
+        coremap[i].pte = NULL;
+        coremap[i].recently_used = false;
+    }
+    buddy_free_run(start_point, chunk);
+    spinlock_release(&coremap_spinlock);
+    
+}
+
+/*
+ * Pin the frame of a resident PTE whose last reference is going away,
+ * so vm_evict can't pick it between here and free_kpages. Call with
+ * the PTE locked. If the evictor has pinned it already it is waiting
+ * for the PTE lock; we return false and it frees the PTE and the
+ * frame when it sees the PTE has no references left.
+ */
+bool
+vm_frame_claim(paddr_t pa)
+{
+    struct coremap_entry *e = &coremap[pa/PAGE_SIZE];
+    bool claimed;
+    
+    spinlock_acquire(&coremap_spinlock);
+    claimed = e->page_status != 3;
+    if(claimed){
+        KASSERT(e->page_status == USERPAGE);
+        e->page_status = 3;
+    }
+    spinlock_release(&coremap_spinlock);
+    return claimed;
+}
+
+unsigned
+int
+coremap_used_bytes() {
+    unsigned int used;
+    
+    spinlock_acquire(&coremap_spinlock);
+    used = bytes_used;
+    for(int i = 0; i < MAXCPUS; i++){
+        used -= pagecache[i].count * PAGE_SIZE;
+    }
+    used -= prezero_count * PAGE_SIZE;
+    spinlock_release(&coremap_spinlock);
+    return used;
+}
+
+/*
+ * TLB shootdown.
+ *
+ * coremap[].tlb_cpus records every CPU that has loaded a frame into
+ * its TLB since the last shootdown of that frame; bits are only
+ * cleared by a shootdown, so the mask may be too big but never too
+ * small. Callers hold the PTE locks of the pages, which keeps
+ * vm_fault from loading them again until they are done.
+ *
+ * The sender spins with interrupts on until every target has counted
+ * itself done, so it can still answer shootdowns sent to it.
+ */
+struct tlbshootdown_wait {
+    struct spinlock tw_lock;
+    unsigned tw_done;
+};
+
+/*
+ * Which address space each CPU's TLB currently holds entries for, by
+ * as_id (0 for none). as_activate leaves the TLB alone when switching
+ * back to the same one. Only written by the CPU itself at splhigh.
+ */
+static volatile unsigned tlb_asid[MAXCPUS];
+
+/* as_activate outcomes per CPU, for vm_printfaultstats */
+static unsigned tlb_flushes[MAXCPUS];
+static unsigned tlb_flushes_skipped[MAXCPUS];
+
+static
+void
+tlb_flush_local(void)
+{
+    int spl = splhigh();
+    for(int i = 0; i < NUM_TLB; i++){
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_slots_freed();
+    splx(spl);
+}
+
+static
+void
+tlb_invalidate_batch(const struct tlbshootdown *ts)
+{
+    uint32_t ehi, elo;
+    int spl, i;
+    
+    spl = splhigh();
+    if(ts->ts_count == 0){
+        /* Whole-address-space flush; see vm_tlb_flush_as. */
+        if(tlb_asid[curcpu->c_number] == ts->ts_asid){
+            tlb_flush_local();
+        }
+        splx(spl);
+        return;
+    }
+    for(unsigned n = 0; n < ts->ts_count; n++){
+        if(ts->ts_vaddr[n] == TLBSHOOTDOWN_ANYVADDR){
+            for(i = 0; i < NUM_TLB; i++){
+                tlb_read(&ehi, &elo, i);
+                if((elo & TLBLO_VALID) &&
+                   (elo & TLBLO_PPAGE) == ts->ts_paddr[n]){
+                    tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                    tlb_slots_freed();
+                }
+            }
+            continue;
+        }
+        i = tlb_probe(ts->ts_vaddr[n], 0);
+        if(i < 0){
+            continue;
+        }
+        tlb_read(&ehi, &elo, i);
+        if((elo & TLBLO_PPAGE) == ts->ts_paddr[n]){
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            tlb_slots_freed();
+        }
+    }
+    splx(spl);
+}
+
+/* Run a shootdown here and on the other CPUs in `mask', and wait for it. */
+static
+void
+shootdown_send(struct tlbshootdown *ts, uint32_t mask)
+{
+    struct tlbshootdown_wait wait;
+    unsigned sent, done;
+    int spl;
+    
+    ts->ts_wait = &wait;
+    spinlock_init(&wait.tw_lock);
+    wait.tw_done = 0;
+    
+    /* Stay on this CPU until the local part and the sends are done. */
+    spl = splhigh();
+    if(mask & ((uint32_t)1 << curcpu->c_number)){
+        tlb_invalidate_batch(ts);
+    }
+    sent = ipi_tlbshootdown_mask(mask, ts);
+    splx(spl);
+    
+    if(sent > 0){
+        vm_pageout_stats.shootdowns++;
+    }
+    do {
+        spinlock_acquire(&wait.tw_lock);
+        done = wait.tw_done;
+        spinlock_release(&wait.tw_lock);
+    } while(done < sent);
+    spinlock_cleanup(&wait.tw_lock);
+}
+
+static
+void
+vm_shootdown(const vaddr_t *vaddrs, const paddr_t *paddrs, unsigned n)
+{
+    struct tlbshootdown ts;
+    uint32_t mask = 0;
+    
+    KASSERT(n > 0 && n <= TLBSHOOTDOWN_BATCH);
+    
+    spinlock_acquire(&coremap_spinlock);
+    for(unsigned i = 0; i < n; i++){
+        mask |= coremap[paddrs[i]/PAGE_SIZE].tlb_cpus;
+        /* The zero page is mapped at other addresses too; keep its bits. */
+        if(paddrs[i] != zero_pte->ppn){
+            coremap[paddrs[i]/PAGE_SIZE].tlb_cpus = 0;
+        }
+    }
+    spinlock_release(&coremap_spinlock);
+    if(mask == 0){
+        return;
+    }
+    
+    ts.ts_count = n;
+    ts.ts_asid = 0;
+    for(unsigned i = 0; i < n; i++){
+        ts.ts_vaddr[i] = vaddrs[i];
+        ts.ts_paddr[i] = paddrs[i];
+    }
+    shootdown_send(&ts, mask);
+}
+
+/*
+ * The address to shoot PTE's frame down at, given that VADDR maps it:
+ * VADDR itself, or TLBSHOOTDOWN_ANYVADDR for a vnode page cache page,
+ * which other processes may map somewhere else.
+ */
+static
+vaddr_t
+pte_shootdown_vaddr(struct page_table_entry *pte, vaddr_t vaddr)
+{
+    return pte->vpage != NULL ? TLBSHOOTDOWN_ANYVADDR : vaddr;
+}
+
+/*
+ * Load `as' into this CPU's TLB, flushing only if the TLB holds some
+ * other address space's entries.
+ */
+void
+vm_tlb_activate(struct addrspace *as)
+{
+    int spl;
+    unsigned me;
+    
+    spl = splhigh();
+    me = curcpu->c_number;
+    if(tlb_asid[me] != as->as_id){
+        tlb_flush_local();
+        tlb_asid[me] = as->as_id;
+        tlb_flushes[me]++;
+    } else {
+        tlb_flushes_skipped[me]++;
+    }
+    splx(spl);
+}
+
+/*
+ * Flush every CPU whose TLB holds entries for `as'. Used when all of
+ * its pages lose write permission at once (fork). The asid check is
+ * made again on the target, so a CPU that has moved on does nothing.
+ */
+void
+vm_tlb_flush_as(struct addrspace *as)
+{
+    struct tlbshootdown ts;
+    uint32_t mask = 0;
+    
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        if(tlb_asid[i] == as->as_id){
+            mask |= (uint32_t)1 << i;
+        }
+    }
+    if(mask == 0){
+        return;
+    }
+    ts.ts_count = 0;
+    ts.ts_asid = as->as_id;
+    shootdown_send(&ts, mask);
+}
+
+/*
+ * Drop AS's mapping of PADDR at VADDR on every CPU whose TLB holds AS.
+ * For a page AS stops sharing while others keep it (copy-on-write and
+ * the zero page): no other CPU can have AS's entry, and usually there
+ * is no other CPU to tell. The frame's tlb_cpus is left alone, since
+ * the other mappings are still there.
+ */
+static
+void
+vm_tlb_invalidate_as(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+    struct tlbshootdown ts;
+    uint32_t mask = 0;
+    
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        if(tlb_asid[i] == as->as_id){
+            mask |= (uint32_t)1 << i;
+        }
+    }
+    if(mask == 0){
+        return;
+    }
+    ts.ts_count = 1;
+    ts.ts_asid = as->as_id;
+    ts.ts_vaddr[0] = vaddr;
+    ts.ts_paddr[0] = paddr;
+    shootdown_send(&ts, mask);
+}
+
+/*
+ * Drop a resident page's mapping at VADDR on every CPU. Call with PTE
+ * locked. A vnode page cache page may be mapped at other addresses in
+ * other processes, and the shootdown clears the frame's tlb_cpus, so
+ * all of its mappings go at once.
+ */
+void
+vm_tlb_invalidate(vaddr_t vaddr, struct page_table_entry *pte)
+{
+    if(pte->state == false){
+        vaddr = pte_shootdown_vaddr(pte, vaddr);
+        vm_shootdown(&vaddr, &pte->ppn, 1);
+    }
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+    tlb_invalidate_batch(ts);
+    spinlock_acquire(&ts->ts_wait->tw_lock);
+    ts->ts_wait->tw_done++;
+    spinlock_release(&ts->ts_wait->tw_lock);
+}
+
+/*
+ * Fault latency accounting. vm_fault_stats is updated on every call
+ * to vm_fault and printed (and reset) by the "vmf" menu command.
+ */
+static struct spinlock vm_stats_spinlock = SPINLOCK_INITIALIZER;
+static struct {
+    unsigned long faults;
+    uint64_t fault_nsecs;
+    uint64_t max_fault_nsecs;
+    unsigned long around_faults;	/* faults that preloaded neighbours */
+    unsigned long around_loads;		/* neighbour entries preloaded */
+} vm_fault_stats;
+
+/* Record that this CPU may now hold frame ELO in its TLB. Call at splhigh. */
+static
+void
+tlb_note_frame(uint32_t elo)
+{
+    uint32_t bit;
+    struct coremap_entry *e = &coremap[(elo & TLBLO_PPAGE)/PAGE_SIZE];
+    
+    bit = (uint32_t)1 << curcpu->c_number;
+    if(!(e->tlb_cpus & bit)){
+        spinlock_acquire(&coremap_spinlock);
+        e->tlb_cpus |= bit;
+        spinlock_release(&coremap_spinlock);
+    }
+}
+
+/*
+ * Load a translation into this CPU's TLB, replacing any existing
+ * entry for the same page.
+ */
+static
+void
+vm_tlb_load(uint32_t ehi, uint32_t elo)
+{
+    int spl, result;
+    
+    spl = splhigh();
+    tlb_note_frame(elo);
+    result = tlb_probe(ehi, 0);
+    if(result < 0){
+        tlb_random(ehi, elo);
+    } else {
+        tlb_write(ehi, elo, result);
+    }
+    splx(spl);
+}
+
+/*
+ * Fault-around.
+ *
+ * After a TLB miss is handled, the other resident pages of the same
+ * region in the aligned window of vm_faultaround pages around it are
+ * loaded too, so code walking an array takes one miss per window
+ * rather than one per page. Neighbours only go into free TLB slots;
+ * live entries are never pushed out for them. Each CPU remembers
+ * where it last found a free slot, and that it has none left until
+ * something is invalidated.
+ *
+ * A preloaded entry counts as a reference at the next vm_tlb_sample
+ * whether or not it was used; with a small window that costs little.
+ * The MIPS TLB doesn't say which entries were used, so the misses
+ * saved show up as fewer faults in vmf, not as a counter of their own.
+ */
+unsigned vm_faultaround = 8;
+
+static unsigned tlb_cursor[MAXCPUS];
+static bool tlb_full[MAXCPUS];
+
+/* Some entries on this CPU were just invalidated. Call at splhigh. */
+static
+void
+tlb_slots_freed(void)
+{
+    tlb_full[curcpu->c_number] = false;
+}
+
+/* Return an invalid TLB slot on this CPU, or -1. Call at splhigh. */
+static
+int
+tlb_free_slot(void)
+{
+    unsigned me = curcpu->c_number;
+    uint32_t ehi, elo;
+    unsigned i;
+    
+    if(tlb_full[me]){
+        return -1;
+    }
+    for(unsigned n = 0; n < NUM_TLB; n++){
+        i = (tlb_cursor[me] + n) % NUM_TLB;
+        tlb_read(&ehi, &elo, i);
+        if(!(elo & TLBLO_VALID)){
+            tlb_cursor[me] = (i + 1) % NUM_TLB;
+            return i;
+        }
+    }
+    tlb_full[me] = true;
+    return -1;
+}
+
+/*
+ * Preload the resident neighbours of VA in region R. Called with no
+ * PTE locks held; each neighbour is locked on its own.
+ */
+static
+void
+fault_around(struct addrspace *as, struct region *r, vaddr_t va)
+{
+    struct page_table_entry *pte;
+    vaddr_t start, end, a;
+    unsigned window = vm_faultaround;
+    unsigned loaded = 0;
+    int spl, slot = 0;
+    
+    if(window < 2){
+        return;
+    }
+    start = va & ~((vaddr_t)window * PAGE_SIZE - 1);
+    end = start + window * PAGE_SIZE;
+    if(start < r->region_start_address){
+        start = r->region_start_address;
+    }
+    if(end > r->region_start_address + r->region_size){
+        end = r->region_start_address + r->region_size;
+    }
+    
+    for(a = start; a < end && slot >= 0; a += PAGE_SIZE){
+        if(a == va){
+            continue;
+        }
+        pte = pt_lookup(as, a);
+        if(pte == NULL){
+            continue;
+        }
+        pte_lock(pte);
+        if(pte->state == false){
+            uint32_t elo = pte_tlblo(pte, r);
+            
+            spl = splhigh();
+            if(tlb_probe(a, 0) < 0){
+                slot = tlb_free_slot();
+                if(slot >= 0){
+                    tlb_note_frame(elo);
+                    tlb_write(a, elo, slot);
+                    loaded++;
+                }
+            }
+            splx(spl);
+        }
+        pte_unlock(pte);
+    }
+    
+    if(loaded > 0){
+        spinlock_acquire(&vm_stats_spinlock);
+        vm_fault_stats.around_faults++;
+        vm_fault_stats.around_loads += loaded;
+        spinlock_release(&vm_stats_spinlock);
+    }
+}
+
+/*
+ * Bring a swapped-out page, mapped at VA, back in. The pages after VA
+ * are read in the same request as long as they are swapped out to the
+ * following slots, which is how vm_evict lays out pages evicted
+ * together. Readahead is skipped when memory is short. Call with
+ * PTE locked; the readahead pages are left resident but not mapped.
+ */
+static
+int
+vm_swapin(struct addrspace *as, vaddr_t va, struct page_table_entry *pte)
+{
+    struct page_table_entry *ra[SWAP_CLUSTER];
+    paddr_t frames[SWAP_CLUSTER];
+    unsigned n, i;
+    bool room;
+    int result;
+    
+    frames[0] = getppages_zero(1, 3, pte, false);
+    if(frames[0] == 0){
+        return ENOMEM;
+    }
+    ra[0] = pte;
+    n = 1;
+    
+    spinlock_acquire(&coremap_spinlock);
+    room = buddy_npages_free > pageout_high;
+    spinlock_release(&coremap_spinlock);
+    
+    /* Neighbours are locked in address order, same as vm_evict. */
+    while(room && n < SWAP_CLUSTER){
+        struct page_table_entry *next;
+        
+        next = pt_lookup(as, va + n*PAGE_SIZE);
+        if(next == NULL){
+            break;
+        }
+        pte_lock(next);
+        if(next->state == false ||
+           next->offset != pte->offset + (int)(n*PAGE_SIZE)){
+            pte_unlock(next);
+            break;
+        }
+        frames[n] = getppages_zero(1, 3, next, false);
+        if(frames[n] == 0){
+            pte_unlock(next);
+            break;
+        }
+        ra[n++] = next;
+    }
+    
+    result = block_io(frames, n, pte->offset, UIO_READ);
+    for(i = 0; i < n; i++){
+        if(result){
+            free_kpages(PADDR_TO_KVADDR(frames[i]));
+        } else {
+            ra[i]->state = false;
+            ra[i]->dirty = false;
+            ra[i]->ppn = frames[i];
+            vm_set_owner(frames[i], as);
+            coremap[frames[i]/PAGE_SIZE].page_status = 2;
+        }
+        if(i > 0){
+            pte_unlock(ra[i]);
+        }
+    }
+    if(result){
+        return result;
+    }
+    
+    spinlock_acquire(&coremap_spinlock);
+    vm_pageout_stats.swap_reads++;
+    vm_pageout_stats.pages_read += n;
+    spinlock_release(&coremap_spinlock);
+    return 0;
+}
+
+/*
+ * Fill the (already zeroed) frame PA for user page VA with whatever
+ * part of region R's file backing overlaps it. Returns true in
+ * *filled if any of the page came from the file.
+ */
+static
+int
+region_read(struct region *r, vaddr_t va, paddr_t pa, bool *filled)
+{
+    struct iovec iov;
+    struct uio u;
+    vaddr_t start, end;
+    int result;
+    
+    *filled = false;
+    if(r->region_vnode == NULL){
+        return 0;
+    }
+    start = va > r->region_filestart ? va : r->region_filestart;
+    end = va + PAGE_SIZE;
+    if(end > r->region_filestart + r->region_filesize){
+        end = r->region_filestart + r->region_filesize;
+    }
+    if(start >= end){
+        return 0;
+    }
+    
+    uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(pa) + (start - va)),
+              end - start,
+              r->region_fileoffset + (start - r->region_filestart),
+              UIO_READ);
+    result = VOP_READ(r->region_vnode, &u);
+    if(result){
+        return result;
+    }
+    if(u.uio_resid != 0){
+        /* The file shrank under us. */
+        return EIO;
+    }
+    *filled = true;
+    
+    spinlock_acquire(&coremap_spinlock);
+    vm_pageout_stats.file_reads++;
+    spinlock_release(&coremap_spinlock);
+    return 0;
+}
+
+/*
+ * Whether user page VA of region R can live in the vnode page cache:
+ * the region must be read-only or MAP_SHARED, and the whole page must
+ * come from the file at a page-aligned offset, returned in *offp. In
+ * a MAP_SHARED region the last page may stop short at EOF; the rest of
+ * it reads as zeroes, and vpage_writeback doesn't write it back.
+ */
+static
+bool
+region_page_shared(struct region *r, vaddr_t va, off_t *offp)
+{
+    off_t off;
+    
+    if(r->region_vnode == NULL){
+        return false;
+    }
+    /* Private writable pages get their own copy from the start. */
+    if((r->region_permission & REGION_W) &&
+       !(r->region_flags & REGION_SHARED)){
+        return false;
+    }
+    if(va < r->region_filestart ||
+       va >= r->region_filestart + r->region_filesize){
+        return false;
+    }
+    if(!(r->region_flags & REGION_SHARED) &&
+       va + PAGE_SIZE > r->region_filestart + r->region_filesize){
+        return false;
+    }
+    off = r->region_fileoffset + (va - r->region_filestart);
+    if(off % PAGE_SIZE != 0){
+        return false;
+    }
+    *offp = off;
+    return true;
+}
+
+/*
+ * Whether user page VA of region R is plain zero-fill, so a read of it
+ * can be given the zero page. MAP_SHARED regions are left out; their
+ * pages take stores in place instead of being copied.
+ */
+static
+bool
+region_page_zero(struct region *r, vaddr_t va)
+{
+    if(r->region_flags & REGION_SHARED){
+        return false;
+    }
+    return r->region_vnode == NULL ||
+           va + PAGE_SIZE <= r->region_filestart ||
+           va >= r->region_filestart + r->region_filesize;
+}
+
+/* Map the zero page read-only at VA. */
+static
+int
+vm_map_zero(struct addrspace *as, vaddr_t va)
+{
+    pte_lock(zero_pte);
+    zero_pte->refcount++;
+    if(pt_insert(as, va, zero_pte)){
+        zero_pte->refcount--;
+        pte_unlock(zero_pte);
+        return ENOMEM;
+    }
+    vm_tlb_load(va, zero_pte->ppn | TLBLO_VALID);
+    pte_unlock(zero_pte);
+    
+    spinlock_acquire(&coremap_spinlock);
+    vm_pageout_stats.zero_maps++;
+    spinlock_release(&coremap_spinlock);
+    return 0;
+}
+
+/*
+ * Re-read a clean file page, mapped at VA in region R, that the
+ * evictor dropped. Call with PTE locked.
+ */
+static
+int
+vm_filein(struct addrspace *as, struct region *r, vaddr_t va,
+          struct page_table_entry *pte)
+{
+    paddr_t pa;
+    bool filled;
+    int result;
+    
+    pa = getppages(1, 3, pte);
+    if(pa == 0){
+        return ENOMEM;
+    }
+    result = region_read(r, va, pa, &filled);
+    if(result){
+        free_kpages(PADDR_TO_KVADDR(pa));
+        return result;
+    }
+    KASSERT(filled);
+    pte->ppn = pa;
+    pte->state = false;
+    pte->dirty = false;
+    vm_set_owner(pa, as);
+    coremap[pa/PAGE_SIZE].page_status = 2;
+    return 0;
+}
+
+/*
+ * TLB low word for a resident PTE mapped through region R. Pages
+ * shared copy-on-write, and clean pages that still match their swap
+ * slot or file, are mapped read-only so the first write comes back as
+ * VM_FAULT_READONLY. In a MAP_SHARED region sharing doesn't matter;
+ * every mapping writes the same page. Pages of a read-only region are
+ * always read-only, dirty or not.
+ */
+static
+uint32_t
+pte_tlblo(struct page_table_entry *pte, struct region *r)
+{
+    uint32_t elo = pte->ppn | TLBLO_VALID;
+    
+    if(!(r->region_permission & REGION_W)){
+        return elo;
+    }
+    if(pte->dirty && (pte->refcount == 1 ||
+                      (r->region_flags & REGION_SHARED))){
+        elo |= TLBLO_DIRTY;
+    }
+    return elo;
+}
+
+/*
+ * Break copy-on-write sharing: give AS its own copy of the page in
+ * *PTEP, mapped at VA, and drop its reference to the shared PTE.
+ * Called with the shared PTE resident and locked; returns with the
+ * private PTE locked instead. A copy of the zero page is just a
+ * zeroed frame.
+ *
+ * getppages may wait for the pageout daemon, which may in turn be
+ * waiting for the shared PTE's lock to evict it, so the lock is
+ * dropped while the frame is found. If the page was evicted or lost
+ * its other sharers meanwhile, returns EAGAIN with the shared PTE
+ * locked again, and the caller lets the access fault afresh.
+ */
+static
+int
+pte_unshare(struct addrspace *as, vaddr_t va, struct page_table_entry **ptep)
+{
+    struct page_table_entry *old = *ptep;
+    struct page_table_entry *new;
+    int result;
+    
+    new = kmem_cache_alloc(&pte_cache);
+    if(new == NULL){
+        return ENOMEM;
+    }
+    pte_lock(new);
+    
+    /* Our page table still holds a reference, so OLD stays put. */
+    pte_unlock(old);
+    if(old == zero_pte){
+        new->ppn = getppages(1,3, new);
+    } else {
+        new->ppn = getppages_zero(1,3, new, false);
+    }
+    pte_lock(old);
+    
+    if(new->ppn == 0){
+        pte_unlock(new);
+        kmem_cache_free(&pte_cache, new);
+        return ENOMEM;
+    }
+    if(old->state == true || old->refcount == 1){
+        free_kpages(PADDR_TO_KVADDR(new->ppn));
+        pte_unlock(new);
+        kmem_cache_free(&pte_cache, new);
+        return EAGAIN;
+    }
+    if(old != zero_pte){
+        memmove((void *)PADDR_TO_KVADDR(new->ppn),
+                (const void *)PADDR_TO_KVADDR(old->ppn),
+                PAGE_SIZE);
+    }
+    
+    new->vpn = va;
+    new->state = false;
+    new->dirty = true;
+    new->offset = -1;
+    new->refcount = 1;
+    new->vpage = NULL;
+    vm_set_owner(new->ppn, as);
+    coremap[new->ppn/PAGE_SIZE].page_status = 2;
+    
+    KASSERT(old->refcount > 1);
+    old->refcount--;
+    
+    pt_remove(as, va);
+    result = pt_insert(as, va, new);
+    KASSERT(result == 0);
+    /*
+     * The old page may still be in the TLB of any CPU this address
+     * space has run on, whether other threads of ours or a vfork
+     * parent's are there now or we go back to it later.
+     */
+    vm_tlb_invalidate_as(as, va, old->ppn);
+    pte_unlock(old);
+    
+    *ptep = new;
+    return 0;
+}
+
+/*
+ * Remember that VA maps PTE through region R, for vm_tlb_refill. Call
+ * with as_lock held.
+ */
+static
+void
+stlb_fill(struct addrspace *as, vaddr_t va, struct page_table_entry *pte,
+          struct region *r)
+{
+    struct stlb_entry *se = &as->as_stlb[STLB_INDEX(va)];
+    
+    as->as_stlb_seq++;
+    membar_store_store();
+    se->se_vaddr = va;
+    se->se_pte = pte;
+    se->se_writable = (r->region_permission & REGION_W) != 0;
+    membar_store_store();
+    as->as_stlb_seq++;
+}
+
+/* The body of vm_handle_fault, with as_lock held. */
+static
+int
+vm_fault_locked(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+    bool vaddr_in_segment = false;
+    int result;
+    
+    struct region *current_region = as->rbase;
+    while(current_region != NULL){
+        if(faultaddress >= current_region->region_start_address && faultaddress < current_region->region_start_address + current_region->region_size){
+            vaddr_in_segment = true;
+            break;
+        } else {
+            current_region = current_region->next;
+        }
+    }
+    
+    if(!vaddr_in_segment){
+        return EFAULT;
+    }
+    if(faulttype != VM_FAULT_READ &&
+       !(current_region->region_permission & REGION_W)){
+        return EFAULT;
+    }
+    
+    struct page_table_entry *current_page_table = pt_lookup(as, faultaddress);
+    off_t fileoff;
+    bool shared = region_page_shared(current_region, faultaddress, &fileoff);
+    if(current_page_table == NULL && shared){
+        /* Another process running the same binary may have it. */
+        current_page_table = vpage_lookup(current_region->region_vnode,
+                                          fileoff);
+        if(current_page_table != NULL){
+            if(pt_insert(as, faultaddress, current_page_table)){
+                pte_release(current_page_table);
+                return ENOMEM;
+            }
+            spinlock_acquire(&coremap_spinlock);
+            vm_pageout_stats.text_shared++;
+            spinlock_release(&coremap_spinlock);
+        }
+    }
+    if(current_page_table != NULL){
+        pte_lock(current_page_table);
+        if(current_page_table->state == true){
+            if(current_page_table->offset != -1){
+                result = vm_swapin(as, faultaddress, current_page_table);
+            } else {
+                result = vm_filein(as, current_region, faultaddress,
+                                   current_page_table);
+            }
+            if(result){
+                pte_unlock(current_page_table);
+                return result;
+            }
+        }
+        if(faulttype != VM_FAULT_READ){
+            if(current_page_table == zero_pte ||
+               (current_page_table->refcount > 1 &&
+                !(current_region->region_flags & REGION_SHARED))){
+                result = pte_unshare(as, faultaddress, &current_page_table);
+                if(result){
+                    pte_unlock(current_page_table);
+                    return result == EAGAIN ? 0 : result;
+                }
+            } else {
+                current_page_table->dirty = true;
+            }
+        }
+        vm_tlb_load(faultaddress,
+                    pte_tlblo(current_page_table, current_region));
+        coremap[current_page_table->ppn/PAGE_SIZE].recently_used = true;
+        pte_unlock(current_page_table);
+        stlb_fill(as, faultaddress, current_page_table, current_region);
+        if(faulttype != VM_FAULT_READONLY){
+            fault_around(as, current_region, faultaddress);
+        }
+        return 0;
+    }
+    
+    if(faulttype == VM_FAULT_READ &&
+       region_page_zero(current_region, faultaddress)){
+        result = vm_map_zero(as, faultaddress);
+        if(result == 0){
+            stlb_fill(as, faultaddress, zero_pte, current_region);
+            fault_around(as, current_region, faultaddress);
+        }
+        return result;
+    }
+    
+    struct page_table_entry *new_pte = kmem_cache_alloc(&pte_cache);
+    if(new_pte == NULL){
+        return ENOMEM;
+    }
+    new_pte->vpn = faultaddress;
+    pte_lock(new_pte);
+    new_pte->ppn = getppages(1,3, new_pte);
+    if(new_pte->ppn == 0){
+        pte_unlock(new_pte);
+        kmem_cache_free(&pte_cache, new_pte);
+        return ENOMEM;
+    }
+    bool filled;
+    result = region_read(current_region, faultaddress, new_pte->ppn, &filled);
+    if(result){
+        free_kpages(PADDR_TO_KVADDR(new_pte->ppn));
+        pte_unlock(new_pte);
+        kmem_cache_free(&pte_cache, new_pte);
         return result;
     }
+    new_pte->offset = -1;
+    new_pte->state = false;
+    /* A file page can be dropped and re-read until it is written. */
+    new_pte->dirty = !filled || faulttype != VM_FAULT_READ;
+    new_pte->refcount = 1;
+    new_pte->vpage = NULL;
+    if(pt_insert(as, faultaddress, new_pte)){
+        free_kpages(PADDR_TO_KVADDR(new_pte->ppn));
+        pte_unlock(new_pte);
+        kmem_cache_free(&pte_cache, new_pte);
+        return ENOMEM;
+    }
+
+    vm_set_owner(new_pte->ppn, as);
+    vm_tlb_load(faultaddress, pte_tlblo(new_pte, current_region));
+    coremap[new_pte->ppn/PAGE_SIZE].recently_used = true;
+    coremap[new_pte->ppn/PAGE_SIZE].page_status = 2;
+    pte_unlock(new_pte);
+    if(shared){
+        /* After dropping the PTE lock; vpage_lock comes first. */
+        vpage_insert(current_region->region_vnode, fileoff, new_pte);
+    }
+    stlb_fill(as, faultaddress, new_pte, current_region);
+    fault_around(as, current_region, faultaddress);
     return 0;
 }
+
+static
+int
+vm_handle_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct addrspace *as;
+    int result;
+    
+    faultaddress &= PAGE_FRAME;
+    
+    switch (faulttype) {
+        case VM_FAULT_READONLY:
+        case VM_FAULT_READ:
+        case VM_FAULT_WRITE:
+            break;
+        default:
+            return EINVAL;
+    }
+    
+    if (curproc == NULL) {
+        return EFAULT;
+    }
+    
+    as = proc_getas();
+    
+    if (as == NULL) {
+        return EFAULT;
+    }
+    
+    lock_acquire(as->as_lock);
+    result = vm_fault_locked(as, faulttype, faultaddress);
+    lock_release(as->as_lock);
+    return result;
+}
+
+/*
+ * TLB refill fast path. A miss on a resident page that is in the
+ * address space's software TLB is loaded straight from the PTE, at
+ * splhigh and without the PTE lock. That is safe because the evictor
+ * pins a frame (under coremap_spinlock) before it shoots the frame
+ * down: either we see the pin and take the slow path, or our CPU is
+ * in the frame's tlb_cpus mask and the shootdown's IPI, which can't
+ * be taken until we are done, removes what we loaded. Another thread
+ * of the process may change the software TLB entry while we use it;
+ * as_stlb_seq catches that, and since the change comes before any
+ * shootdown of the old page, the same argument covers what we loaded
+ * if the sequence hasn't moved by the time we have loaded it. Anything
+ * unusual (a write to a page that isn't writable yet, a page out on
+ * swap) goes to vm_handle_fault.
+ */
+
+static
+bool
+vm_tlb_refill(int faulttype, vaddr_t va)
+{
+    struct addrspace *as;
+    struct stlb_entry *se;
+    struct page_table_entry *pte;
+    struct coremap_entry *e;
+    uint32_t elo, bit;
+    unsigned seq;
+    int spl, slot;
+    bool done = false;
+    
+    if(faulttype == VM_FAULT_READONLY){
+        return false;
+    }
+    as = proc_getas();
+    if(as == NULL){
+        return false;
+    }
+    va &= PAGE_FRAME;
+    se = &as->as_stlb[STLB_INDEX(va)];
+    
+    spl = splhigh();
+    seq = as->as_stlb_seq;
+    membar_load_load();
+    pte = se->se_pte;
+    if((seq & 1) || pte == NULL || se->se_vaddr != va || pte->state){
+        goto out;
+    }
+    e = &coremap[pte->ppn/PAGE_SIZE];
+    if(pte != zero_pte && (e->page_status != USERPAGE || e->pte != pte)){
+        goto out;
+    }
+    elo = pte->ppn | TLBLO_VALID;
+    if(pte->dirty && pte->refcount == 1 && se->se_writable){
+        elo |= TLBLO_DIRTY;
+    } else if(faulttype == VM_FAULT_WRITE){
+        goto out;
+    }
+    
+    bit = (uint32_t)1 << curcpu->c_number;
+    if(!(e->tlb_cpus & bit)){
+        spinlock_acquire(&coremap_spinlock);
+        if(pte != zero_pte && (e->page_status != USERPAGE || e->pte != pte)){
+            spinlock_release(&coremap_spinlock);
+            goto out;
+        }
+        e->tlb_cpus |= bit;
+        spinlock_release(&coremap_spinlock);
+    }
+    slot = tlb_probe(va, 0);
+    if(slot < 0){
+        tlb_random(va, elo);
+    } else {
+        tlb_write(va, elo, slot);
+    }
+    membar_any_any();
+    if(as->as_stlb_seq != seq){
+        slot = tlb_probe(va, 0);
+        if(slot >= 0){
+            tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+            tlb_slots_freed();
+        }
+        goto out;
+    }
+    e->recently_used = true;
+    vmstat_cpu[curcpu->c_number].vs_stlb_refills++;
+    done = true;
+out:
+    splx(spl);
+    return done;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct timespec before, after, duration;
+    uint64_t nsecs;
+    int result;
+    
+    if(faulttype == VM_FAULT_READONLY){
+        VMSTAT_ADD(vs_tlb_modifies, 1);
+    } else {
+        VMSTAT_ADD(vs_tlb_misses, 1);
+    }
+    if(vm_tlb_refill(faulttype, faultaddress)){
+        return 0;
+    }
+    
+    gettime(&before);
+    result = vm_handle_fault(faulttype, faultaddress);
+    gettime(&after);
+    
+    timespec_sub(&after, &before, &duration);
+    nsecs = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+    
+    spinlock_acquire(&vm_stats_spinlock);
+    vm_fault_stats.faults++;
+    vm_fault_stats.fault_nsecs += nsecs;
+    if(nsecs > vm_fault_stats.max_fault_nsecs){
+        vm_fault_stats.max_fault_nsecs = nsecs;
+    }
+    spinlock_release(&vm_stats_spinlock);
+    
+    return result;
+}
+
+void
+vm_printfaultstats(void)
+{
+    unsigned long faults, around_faults, around_loads;
+    uint64_t total, max;
+    struct pageout_stats pageout;
+    
+    spinlock_acquire(&vm_stats_spinlock);
+    faults = vm_fault_stats.faults;
+    total = vm_fault_stats.fault_nsecs;
+    max = vm_fault_stats.max_fault_nsecs;
+    around_faults = vm_fault_stats.around_faults;
+    around_loads = vm_fault_stats.around_loads;
+    vm_fault_stats.around_faults = 0;
+    vm_fault_stats.around_loads = 0;
+    vm_fault_stats.faults = 0;
+    vm_fault_stats.fault_nsecs = 0;
+    vm_fault_stats.max_fault_nsecs = 0;
+    spinlock_release(&vm_stats_spinlock);
+    
+    kprintf("vm faults: %lu\n", faults);
+    if(faults > 0){
+        kprintf("average fault latency: %llu ns\n",
+                (unsigned long long)(total / faults));
+        kprintf("worst fault latency: %llu ns\n",
+                (unsigned long long)max);
+    }
+    kprintf("fault-around (%u pages): %lu entries preloaded by %lu faults\n",
+            vm_faultaround, around_loads, around_faults);
+    
+    spinlock_acquire(&coremap_spinlock);
+    pageout = vm_pageout_stats;
+    vm_pageout_stats.wakeups = 0;
+    vm_pageout_stats.evictions = 0;
+    vm_pageout_stats.direct_evictions = 0;
+    vm_pageout_stats.clean_evictions = 0;
+    vm_pageout_stats.swap_writes = 0;
+    vm_pageout_stats.pages_written = 0;
+    vm_pageout_stats.swap_reads = 0;
+    vm_pageout_stats.pages_read = 0;
+    vm_pageout_stats.file_reads = 0;
+    vm_pageout_stats.text_shared = 0;
+    vm_pageout_stats.file_writes = 0;
+    vm_pageout_stats.blocked = 0;
+    vm_pageout_stats.shootdowns = 0;
+    vm_pageout_stats.zero_maps = 0;
+    vm_pageout_stats.prezeroed = 0;
+    unsigned prezero_pool = prezero_count;
+    spinlock_release(&coremap_spinlock);
+    
+    kprintf("pageout: %lu passes, %lu evicted, %lu direct evictions\n",
+            pageout.wakeups, pageout.evictions, pageout.direct_evictions);
+    kprintf("clean evictions (no swap write): %lu\n",
+            pageout.clean_evictions);
+    kprintf("swap writes: %lu (%lu pages), swap reads: %lu (%lu pages)\n",
+            pageout.swap_writes, pageout.pages_written,
+            pageout.swap_reads, pageout.pages_read);
+    kprintf("pages read from files: %lu, shared from page cache: %lu, "
+            "written back: %lu\n",
+            pageout.file_reads, pageout.text_shared, pageout.file_writes);
+    kprintf("allocations that blocked for a frame: %lu\n",
+            pageout.blocked);
+    kprintf("TLB shootdown batches sent to other CPUs: %lu\n",
+            pageout.shootdowns);
+    kprintf("reads given the zero page: %lu, pre-zeroed frames used: %lu "
+            "(%u in pool)\n",
+            pageout.zero_maps, pageout.prezeroed, prezero_pool);
+    
+    unsigned flushes = 0, skipped = 0;
+    for(int i = 0; i < MAXCPUS; i++){
+        flushes += tlb_flushes[i];
+        skipped += tlb_flushes_skipped[i];
+        tlb_flushes[i] = 0;
+        tlb_flushes_skipped[i] = 0;
+    }
+    kprintf("as_activate: %u TLB flushes, %u skipped\n", flushes, skipped);
+}
+
+/*
+ * Fill in VS for vmstat, then zero the event counts if RESET is set.
+ * A count being bumped on another CPU while we reset can be lost;
+ * these are statistics, so that is fine.
+ */
+void
+vm_getstats(struct vmstat *vs, bool reset)
+{
+    struct vmstat *c;
+    int spl;
+    
+    bzero(vs, sizeof(*vs));
+    spl = splhigh();
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        c = &vmstat_cpu[i];
+        vs->vs_tlb_misses += c->vs_tlb_misses;
+        vs->vs_tlb_modifies += c->vs_tlb_modifies;
+        vs->vs_stlb_refills += c->vs_stlb_refills;
+        vs->vs_page_allocs += c->vs_page_allocs;
+        vs->vs_swap_reads += c->vs_swap_reads;
+        vs->vs_swapins += c->vs_swapins;
+        vs->vs_swap_writes += c->vs_swap_writes;
+        vs->vs_swapouts += c->vs_swapouts;
+        vs->vs_scans += c->vs_scans;
+        vs->vs_evictions += c->vs_evictions;
+        if(reset){
+            bzero(c, sizeof(*c));
+        }
+    }
+    splx(spl);
+    
+    spinlock_acquire(&coremap_spinlock);
+    vs->vs_ncpus = num_cpus;
+    vs->vs_frames = total_coremap_entries;
+    vs->vs_free = buddy_npages_free;
+    vs->vs_free_min = vmstat_free_min < buddy_npages_free ?
+        vmstat_free_min : buddy_npages_free;
+    vs->vs_cached = prezero_count;
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        vs->vs_cached += pagecache[i].count;
+    }
+    if(reset){
+        vmstat_free_min = buddy_npages_free;
+    }
+    spinlock_release(&coremap_spinlock);
+}
+
+void
+vm_printvmstat(void)
+{
+    struct vmstat vs;
+    
+    vm_getstats(&vs, true);
+    kprintf("frames: %u total, %u free (lowest %u), %u in per-CPU caches, "
+            "%u cpus\n", vs.vs_frames, vs.vs_free, vs.vs_free_min,
+            vs.vs_cached, vs.vs_ncpus);
+    kprintf("TLB misses: %llu (%llu refilled from the software TLB), "
+            "read-only faults: %llu\n",
+            (unsigned long long)vs.vs_tlb_misses,
+            (unsigned long long)vs.vs_stlb_refills,
+            (unsigned long long)vs.vs_tlb_modifies);
+    kprintf("frames allocated: %llu, scanned for eviction: %llu, "
+            "evicted: %llu\n",
+            (unsigned long long)vs.vs_page_allocs,
+            (unsigned long long)vs.vs_scans,
+            (unsigned long long)vs.vs_evictions);
+    kprintf("swap-ins: %llu pages in %llu reads, swap-outs: %llu pages "
+            "in %llu writes\n",
+            (unsigned long long)vs.vs_swapins,
+            (unsigned long long)vs.vs_swap_reads,
+            (unsigned long long)vs.vs_swapouts,
+            (unsigned long long)vs.vs_swap_writes);
+}
+
+/*
+ * Move `npages' frames to or from consecutive swap slots starting at
+ * byte offset `place_on_disk', as a single request.
+ */
+static
+int
+block_io(paddr_t *frames, unsigned npages, off_t place_on_disk, enum uio_rw rw)
+{
+    struct iovec iov[SWAP_CLUSTER];
+    struct uio u;
+    
+    KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+    for(unsigned i = 0; i < npages; i++){
+        iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(frames[i]);
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    u.uio_iov = iov;
+    u.uio_iovcnt = npages;
+    u.uio_offset = place_on_disk;
+    u.uio_resid = npages * PAGE_SIZE;
+    u.uio_segflg = UIO_SYSSPACE;
+    u.uio_rw = rw;
+    u.uio_space = NULL;
+    if(rw == UIO_READ){
+        VMSTAT_ADD(vs_swap_reads, 1);
+        VMSTAT_ADD(vs_swapins, npages);
+        return VOP_READ(disk_vnode, &u);
+    }
+    VMSTAT_ADD(vs_swap_writes, 1);
+    VMSTAT_ADD(vs_swapouts, npages);
+    return VOP_WRITE(disk_vnode, &u);
+}
+
+int
+block_write(paddr_t place_on_memory, off_t place_on_disk)
+{
+    return block_io(&place_on_memory, 1, place_on_disk, UIO_WRITE);
+}
+
+int
+block_read(paddr_t place_on_memory, off_t place_on_disk)
+{
+    return block_io(&place_on_memory, 1, place_on_disk, UIO_READ);
+}
@@ -81,6 +81,9 @@ ram_bootstrap(void)
         coremap[i].chunk_size = 0;
         coremap[i].page_status = 0;
         coremap[i].pte = NULL;
+        coremap[i].owner = NULL;
+        coremap[i].last_ref = 0;
+        coremap[i].tlb_cpus = 0;
     }
     
     int coremap_size = total_coremap_entries * sizeof(struct coremap_entry);
@@ -93,6 +96,7 @@ ram_bootstrap(void)
     }
     page_to_evict = initial_space;
     bytes_used = 0;
+    buddy_bootstrap(initial_space);
     
     kprintf("%uk physical memory available\n",
             (lastpaddr-firstpaddr)/1024);
@@ -39,25 +39,83 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct vpage;
+struct kmem_cache;
 
 struct page_table_entry {
-	vaddr_t vpn;
+	vaddr_t vpn;  // user address of the first mapping; unused for the
+	              // zero page, and vnode page cache pages may also be
+	              // mapped at other addresses in other processes
 	paddr_t ppn;
 	//int permission;
-	bool state;  // true for memory and false for disk
+	bool state;  // true when not resident (in swap, or a dropped file page)
 	bool valid;
-	int offset;
-	struct lock *lk;
-	struct page_table_entry *next;
+	bool dirty;  // resident copy differs from its backing store
+	             // (swap slot if offset != -1, else the region's file)
+	int offset;  // swap slot in bytes, or -1; kept across swap-in
+	int refcount;	// address spaces sharing this page copy-on-write
+	struct vpage *vpage;	// entry in the vnode page cache, or NULL
+	bool busy;	// locked; see pte_lock
+	bool wanted;	// somebody is waiting for busy to clear
+};
+
+/*
+ * Two-level page table. The top bits of a user virtual address index
+ * the directory, the next ten bits index a second-level table of PTE
+ * pointers. Second-level tables are allocated the first time a page
+ * in their 4M range is touched, so lookup is two loads regardless of
+ * how many pages are resident.
+ */
+#define PT_L1_SIZE		(USERSPACETOP >> 22)
+#define PT_L2_SIZE		1024
+#define PT_L1_INDEX(vaddr)	((vaddr) >> 22)
+#define PT_L2_INDEX(vaddr)	(((vaddr) >> 12) & (PT_L2_SIZE - 1))
+
+/*
+ * Software TLB: a direct-mapped cache of the PTEs an address space
+ * has recently faulted on, so vm_fault can reload a resident page
+ * without the region walk or the PTE lock. pt_remove drops an entry
+ * when its page is unmapped or replaced.
+ *
+ * Entries are only changed with as_lock held, but are read without
+ * it by other threads of the process. as_stlb_seq is odd while an
+ * entry is being changed, and a reader that sees it move has to
+ * throw away what it read.
+ */
+#define STLB_SIZE		64
+#define STLB_INDEX(vaddr)	(((vaddr) >> 12) & (STLB_SIZE - 1))
+
+struct stlb_entry {
+	vaddr_t se_vaddr;
+	struct page_table_entry *se_pte;	// NULL if empty
+	bool se_writable;	// the page's region has REGION_W
 };
 
 struct region {
 	vaddr_t region_start_address;
         int region_size;
-        int region_permission;
+        int region_permission;	// REGION_R | REGION_W | REGION_X
+	/*
+	 * File backing for executable segments: bytes
+	 * [region_fileoffset, region_fileoffset + region_filesize) of
+	 * region_vnode appear at region_filestart. Everything else in
+	 * the region is zero-fill. region_vnode is NULL if none.
+	 */
+	struct vnode *region_vnode;
+	off_t region_fileoffset;
+	vaddr_t region_filestart;
+	size_t region_filesize;
+	int region_flags;	// REGION_MAPPED | REGION_SHARED
 	struct region *next;
 };
 
+#define REGION_R 4
+#define REGION_W 2
+#define REGION_X 1
+
+#define REGION_MAPPED 1	// made by mmap; can be munmapped
+#define REGION_SHARED 2	// MAP_SHARED: stores go back to the file
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -79,7 +137,18 @@ struct addrspace {
 	vaddr_t heap_start;
 	vaddr_t heap_end;
 	struct region *rbase;
-	struct page_table_entry *ptbase;
+	struct page_table_entry ***pt_dir;
+	unsigned as_resident;	/* frames charged to us; see clock_pick */
+	unsigned as_id;		/* never reused; names us in per-CPU TLB state */
+	vaddr_t mmap_base;	/* lowest mmap region; mappings grow down */
+	/*
+	 * Held by vm_fault (after the software TLB) and by anything
+	 * that changes the regions or the page table, so threads of
+	 * one process fault one at a time. Taken before PTE locks.
+	 */
+	struct lock *as_lock;
+	volatile unsigned as_stlb_seq;
+	struct stlb_entry as_stlb[STLB_SIZE];
 #endif
 };
 
@@ -104,12 +173,28 @@ struct addrspace {
  *                avoid potentially "seeing" it while it's being
  *                destroyed.
  *
- *    as_destroy - dispose of an address space. You may need to change
- *                the way this works if implementing user-level threads.
+ *    as_destroy - dispose of an address space. No thread may still be
+ *                running in it; proc_exit waits for the others first.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_map_file - back part of the region containing VADDR with a
+ *                file, to be paged in by vm_fault. Takes a reference
+ *                to the vnode.
+ *
+ *    as_mmap   - add a file mapping of LEN bytes below the existing
+ *                ones and hand back its address. With no vnode the
+ *                mapping is zero-fill, as for thread stacks.
+ *
+ *    as_munmap - remove a whole mapping made by as_mmap, writing back
+ *                dirty shared pages nobody else maps.
+ *
+ *    as_discard - free the pages of a range but keep the region, so
+ *                they come back zero-filled.
+ *
+ *    as_msync  - write back dirty shared pages in a range.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -135,10 +220,90 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_map_file(struct addrspace *as, vaddr_t vaddr,
+                              struct vnode *v, off_t offset,
+                              size_t filesize);
+int               as_mmap(struct addrspace *as, size_t len, int perm,
+                          int flags, struct vnode *v, off_t offset,
+                          size_t filesize, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+void              as_discard(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+/*
+ * Page table operations, also in addrspace.c:
+ *
+ *    pt_lookup - return the PTE mapping VADDR, or NULL.
+ *
+ *    pt_insert - install PTE at VADDR. May return ENOMEM if a
+ *                second-level table has to be allocated. VADDR is
+ *                usually PTE->vpn, but not for the shared zero page, or
+ *                for a page cache page another process mapped first.
+ *
+ *    pt_remove - unlink and return the PTE mapping VADDR, or NULL,
+ *                dropping it from the software TLB too. Call with
+ *                as_lock held.
+ *
+ *    pte_release - drop one address space's reference to a PTE that
+ *                has already been removed from its page table. The
+ *                last reference frees the frame or swap slot and the
+ *                PTE itself. If the evictor has already picked the
+ *                frame, the PTE is left for it to free instead.
+ *
+ * PTE locks, also in addrspace.c. Sleep locks kept as a busy bit in
+ * the PTE, with waiters parked on a small hashed set of wait channels.
+ * They are not recursive and have no owner.
+ *
+ *    pte_lock_bootstrap - set up the wait channels; called from
+ *                vm_bootstrap before any PTE is made.
+ *
+ *    pte_lock/pte_unlock - lock and unlock PTE, sleeping if needed.
+ */
+
+/*
+ * Vnode page cache, also in addrspace.c. Maps (vnode, file offset)
+ * to a shared PTE, so every address space mapping the same page of
+ * the same file read-only shares one frame (and one swap slot, if it
+ * ever needs one). The cache holds no reference of its own: the entry
+ * goes away when pte_release drops the last one.
+ *
+ *    vpage_bootstrap - set up the cache; called from vm_bootstrap.
+ *
+ *    vpage_lookup - return the cached PTE for VNODE at OFFSET with an
+ *                extra reference taken, or NULL.
+ *
+ *    vpage_insert - enter PTE (which the caller holds a reference to)
+ *                as the cached page for VNODE at OFFSET. Does nothing
+ *                if another PTE got there first or memory is short.
+ *
+ *    vpage_writeback - write a resident cached page back to its file.
+ *                Call with PTE locked.
+ *
+ * Dirty cached pages (from MAP_SHARED mappings) are never swapped;
+ * the evictor, msync and the last pte_release write them to the file.
+ */
+void              vpage_bootstrap(void);
+struct page_table_entry *vpage_lookup(struct vnode *v, off_t offset);
+void              vpage_insert(struct vnode *v, off_t offset,
+                               struct page_table_entry *pte);
+int               vpage_writeback(struct page_table_entry *pte);
+
+/* Where PTEs come from; each one comes unlocked. */
+extern struct kmem_cache pte_cache;
+
+void              pte_lock_bootstrap(void);
+void              pte_lock(struct page_table_entry *pte);
+void              pte_unlock(struct page_table_entry *pte);
+
+struct page_table_entry *pt_lookup(struct addrspace *as, vaddr_t vaddr);
+int               pt_insert(struct addrspace *as, vaddr_t vaddr,
+                            struct page_table_entry *pte);
+struct page_table_entry *pt_remove(struct addrspace *as, vaddr_t vaddr);
+void              pte_release(struct page_table_entry *pte);
+
 
 /*
  * Functions in loadelf.c
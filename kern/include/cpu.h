@@ -156,6 +156,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_mask sends the same shootdown to each other CPU
+ * whose bit is set in a mask of cpu numbers, and returns how many
+ * CPUs it went to.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -170,6 +173,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_mask(uint32_t cpumask,
+			       const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
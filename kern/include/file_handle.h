@@ -4,6 +4,7 @@
 #include <vnode.h>
 #include <uio.h>
 #include <types.h>
+#include <kmem.h>
 
 struct file_handle {
 
@@ -14,6 +15,9 @@ struct file_handle {
 	int type;
 };
 
+/* Where file handles come from (in proc.c) */
+extern struct kmem_cache file_handle_cache;
+
 int file_handle_init(int fd, struct file_handle *file_table[]);
 void file_handle_destroy(int fd, struct file_handle *file_table[]);
 
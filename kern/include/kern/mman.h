@@ -0,0 +1,27 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap() and msync(). Shared with userland
+ * through <unistd.h>.
+ */
+
+/* mmap protections; or together */
+#define PROT_NONE	0
+#define PROT_READ	1
+#define PROT_WRITE	2
+#define PROT_EXEC	4
+
+/* mmap flags; choose one */
+#define MAP_SHARED	1	/* stores go back to the file */
+#define MAP_PRIVATE	2	/* stores go to a private copy */
+
+/* What mmap returns on failure */
+#define MAP_FAILED	((void *)-1)
+
+/* msync flags; writeback is always synchronous */
+#define MS_ASYNC	1
+#define MS_SYNC		2
+#define MS_INVALIDATE	4
+
+#endif /* _KERN_MMAN_H_ */
@@ -196,6 +196,14 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS_msync        121
+#define SYS___vmstat     122
+#define SYS_spawn        123
+#define SYS___thread_create 124
+#define SYS_thread_exit  125
+#define SYS_thread_join  126
+#define SYS_futex_wait   127
+#define SYS_futex_wake   128
 
 /*CALLEND*/
 
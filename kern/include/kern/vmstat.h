@@ -0,0 +1,35 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Virtual memory statistics, as returned by __vmstat() and printed by
+ * the "vmstat" menu command. Shared with userland through <unistd.h>.
+ *
+ * The event counts are summed over all CPUs and run from boot or the
+ * last reset. The levels are what they were when the call was made.
+ */
+struct vmstat {
+	/* Events */
+	__u64 vs_tlb_misses;	/* read and write faults on unmapped pages */
+	__u64 vs_tlb_modifies;	/* writes to pages mapped read-only */
+	__u64 vs_stlb_refills;	/* misses refilled from the software TLB */
+	__u64 vs_page_allocs;	/* frames handed out by getppages */
+	__u64 vs_swap_reads;	/* reads issued to the swap disk */
+	__u64 vs_swapins;	/* pages those reads brought in */
+	__u64 vs_swap_writes;	/* writes issued to the swap disk */
+	__u64 vs_swapouts;	/* pages those writes carried */
+	__u64 vs_scans;		/* frames the eviction clock looked at */
+	__u64 vs_evictions;	/* frames freed by eviction */
+
+	/* Levels */
+	__u32 vs_ncpus;
+	__u32 vs_frames;	/* physical frames, kernel included */
+	__u32 vs_free;		/* frames on the free lists */
+	__u32 vs_free_min;	/* lowest vs_free since the last reset */
+	__u32 vs_cached;	/* free frames held in per-CPU caches */
+};
+
+/* __vmstat flags */
+#define VMSTAT_RESET	1	/* zero the event counts after reading them */
+
+#endif /* _KERN_VMSTAT_H_ */
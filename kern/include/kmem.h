@@ -0,0 +1,78 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches for frequently allocated kernel structures.
+ *
+ * A cache hands out objects of one size, carved from whole pages
+ * ("slabs") so there is no rounding up to a power of two. Each CPU
+ * keeps a small magazine of free objects that it allocates from and
+ * frees to with interrupts off; the cache's spinlock is only taken to
+ * move half a magazine at a time to or from the slabs.
+ *
+ * If a constructor is given, it is run on every object when its slab
+ * is created, and objects must be freed back in that constructed
+ * state; the destructor is run when an empty slab is given back. This
+ * lets callers keep things like a lock in the object across reuse.
+ * A constructor returns 0 or an error code.
+ *
+ * Caches can be defined statically with KMEM_CACHE_INITIALIZER, which
+ * works before anything else is set up, or made with kmem_cache_create.
+ * Either way they show up in the "kh" menu command, and objects in use
+ * are counted by "khu".
+ *
+ *    kmem_cache_create  - make a cache; returns NULL if out of memory.
+ *    kmem_cache_destroy - destroy a cache with no objects in use.
+ *    kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *    kmem_cache_free    - give an object back to the cache it came from.
+ */
+
+#include <spinlock.h>
+#include <platform/maxcpus.h>
+
+#define KMEM_MAGAZINE 8
+
+struct kmem_slab;
+
+struct kmem_magazine {
+	unsigned km_count;
+	void *km_objs[KMEM_MAGAZINE];
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	size_t kc_slotsize;		/* object plus free-list link */
+	size_t kc_linkoff;		/* where the link goes in a slot */
+	unsigned kc_perslab;		/* 0 until the first slab is made */
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	struct kmem_slab *kc_full;	/* slabs without */
+	unsigned kc_nslabs;
+	unsigned kc_nempty;		/* slabs with nothing in use */
+	unsigned kc_inuse;		/* objects out of the slabs */
+	bool kc_listed;
+	struct kmem_cache *kc_next;	/* list of all caches */
+
+	struct kmem_magazine kc_mag[MAXCPUS];
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) {	\
+	.kc_name = (name),					\
+	.kc_size = (size),					\
+	.kc_ctor = (ctor),					\
+	.kc_dtor = (dtor),					\
+	.kc_lock = SPINLOCK_INITIALIZER,			\
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+#endif /* _KMEM_H_ */
@@ -45,6 +45,28 @@ struct thread;
 struct vnode;
 struct file_handle;
 
+/*
+ * A user thread made by thread_create; the thread a process starts
+ * with has none. Records stay on p_uthreads after the thread has been
+ * joined (UT_FREE) so its stack can be used again by the next
+ * thread_create. Protected by the process's lk.
+ */
+struct uthread {
+	int ut_tid;
+	int ut_state;			/* UT_RUNNING, UT_EXITED or UT_FREE */
+	int ut_status;			/* thread_exit code, for thread_join */
+	bool ut_joining;		/* somebody is in thread_join for it */
+	struct thread *ut_thread;	/* while running */
+	vaddr_t ut_stack;		/* base of its stack region */
+	struct uthread *ut_next;
+};
+
+#define UT_RUNNING	0
+#define UT_EXITED	1
+#define UT_FREE		2
+
+#define UTHREAD_STACK_SIZE (64 * PAGE_SIZE)
+
 /*
  * Process structure.
  *
@@ -79,8 +101,34 @@ struct proc {
 	pid_t ppid;
 	bool exit_status;
 	int exit_code;
-	struct semaphore *sem;
 	struct lock *lk;
+
+	/* User threads, under lk; see proc_thread_create */
+	struct uthread *p_uthreads;
+	int p_nexttid;
+	unsigned p_nuthreads;		/* running user threads, ours included */
+	bool p_exiting;			/* the others should stop; see proc_stop */
+	struct thread *p_stopper;	/* who stopped them; NULL: exit */
+	unsigned p_nstopped;		/* threads parked in proc_checkexit */
+	struct cv *p_threadcv;		/* thread_join and proc_single sleep here */
+
+	/*
+	 * Family, under proc_wait_lock. A child is on its parent's
+	 * p_children list while it runs and on p_zombies once it has
+	 * exited, linked through p_sibnext/p_sibprev. p_parent is NULL
+	 * once the parent has gone, and kproc for the menu's process;
+	 * neither kind is on any list.
+	 */
+	struct proc *p_parent;
+	struct proc *p_children;
+	struct proc *p_zombies;
+	struct proc *p_sibnext;
+	struct proc *p_sibprev;
+	struct cv *p_waitcv;		/* waitpid sleeps here */
+
+	/* vfork and spawn; see vfork_release */
+	struct semaphore *p_release;	/* parent waits here, or NULL */
+	bool p_borrowed;		/* p_addrspace is the parent's */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -107,6 +155,52 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
-struct proc *proc_child_create(const char *name);
+/*
+ * Make a child of the current process with its own PID and our open
+ * files. Unless ADOPT is set it has no parent, and so can't be waited
+ * for, until it is passed to proc_adopt; until then it reaps itself if
+ * it exits.
+ */
+int proc_child_create(const char *name, bool adopt, struct proc **childp);
+void proc_adopt(struct proc *child, struct proc *parent);
+
+/* Find a child of the current process by PID; ESRCH or ECHILD if not. */
+int proc_getchild(pid_t pid, struct proc **childp);
+
+/* Exit the current process with a wait status; call thread_exit after. */
+void proc_exit(int status);
+
+/* Wait for and reap a child of the current process (WAIT_ANY for any). */
+int proc_wait(pid_t pid, int options, pid_t *pidp, int *statusp);
+
+/*
+ * User threads in the current process:
+ *
+ *    proc_thread_create - set up a new thread's record and stack and
+ *                count it as running. The caller starts the thread,
+ *                which calls proc_thread_started, or if it can't,
+ *                calls proc_thread_abort.
+ *    proc_thread_exit   - exit the calling thread, unless it's the
+ *                last one, in which case it returns and the caller
+ *                should exit the process instead.
+ *    proc_thread_join   - wait for a thread to exit and get its code.
+ *    proc_stop          - park every other thread, for exit and exec.
+ *                Returns false if another thread is already doing it.
+ *    proc_restart       - let the parked threads carry on.
+ *    proc_single        - make the parked threads exit, stopping them
+ *                first if need be. Returns false as proc_stop does.
+ *    proc_checkexit     - called on the way back to user mode; parks
+ *                the thread while another has the process stopped,
+ *                and exits it if proc_single wants it gone.
+ */
+int proc_thread_create(struct uthread **utp);
+void proc_thread_started(struct uthread *ut);
+void proc_thread_abort(struct uthread *ut);
+void proc_thread_exit(int status);
+int proc_thread_join(int tid, int *statusp);
+bool proc_stop(void);
+void proc_restart(void);
+bool proc_single(bool exiting);
+void proc_checkexit(void);
 
 #endif /* _PROC_H_ */
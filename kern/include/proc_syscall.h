@@ -4,17 +4,29 @@
 #include <types.h>
 #include <kern/limits.h>
 
-extern struct proc *proc_table[250];
-extern struct lock *proc_table_lock;
-extern int exit_table[128];
 struct trapframe;
-extern struct lock *buf_lock;
+struct addrspace;
 
 pid_t sys_fork(int *retval, struct trapframe *tf);
+pid_t sys_vfork(int *retval, struct trapframe *tf);
+int sys_spawn(const_userptr_t path, const_userptr_t argv, int *retval);
+void vfork_release(void);
 void sys_exit(int exitcode);
 pid_t sys_getpid(int *retval);
 pid_t sys_waitpid(pid_t pid, int *status, int options, int *retval);
 int sys_execv(const char *program, char **args, int *retval);
 int sys_sbrk(intptr_t amount, int *retval);
-pid_t next_available_pid(void);
+int sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset,
+             int *retval);
+int sys_munmap(void *addr, size_t len, int *retval);
+int sys_msync(void *addr, size_t len, int flags, int *retval);
+int sys_vmstat(userptr_t buf, int flags, int *retval);
+int sys_thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+                      struct trapframe *tf, int *retval);
+void sys_thread_exit(int code);
+int sys_thread_join(int tid, userptr_t status, int *retval);
+void futex_bootstrap(void);
+void futex_interrupt(struct addrspace *as);
+int sys_futex_wait(userptr_t uaddr, int val, int *retval);
+int sys_futex_wake(userptr_t uaddr, int n, int *retval);
 #endif /* _PROC_SYSCALL_H_ */
@@ -47,6 +47,9 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(void *val, unsigned long foo);
 
+/* Enter user mode with a copy of trap frame TF, which is freed. */
+__DEAD void enter_new_thread(struct trapframe *tf);
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
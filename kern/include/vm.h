@@ -59,6 +59,9 @@ paddr_t getppages(unsigned long npages, int status, struct page_table_entry *pte
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Keep the evictor off a user frame about to be freed; false if too late */
+bool vm_frame_claim(paddr_t pa);
+
 /*
  * Return amount of memory (in bytes) used by allocated coremap pages.  If
  * there are ongoing allocations, this value could change after it is returned
@@ -66,6 +69,37 @@ void free_kpages(vaddr_t addr);
  */
 unsigned int coremap_used_bytes(void);
 
+/* Reference-bit sampling, called from hardclock */
+void vm_tlb_sample(void);
+
+/* Zero one free frame ahead of time; called from the idle loop */
+bool vm_prezero(void);
+
+/* Stop charging frames to an address space that is going away */
+void vm_disown(struct addrspace *as);
+
+/* Fault-around window in pages, a power of two (menu command "vmfa") */
+extern unsigned vm_faultaround;
+
+/* Print and reset the vm_fault counters (menu command "vmf") */
+void vm_printfaultstats(void);
+
+/* Sample (and optionally reset) the vmstat counters; kern/vmstat.h */
+struct vmstat;
+void vm_getstats(struct vmstat *vs, bool reset);
+
+/* Print and reset the vmstat counters (menu command "vmstat") */
+void vm_printvmstat(void);
+
+/* Invalidate a resident page's TLB entries for VADDR on all CPUs */
+void vm_tlb_invalidate(vaddr_t vaddr, struct page_table_entry *pte);
+
+/* Switch this CPU's TLB to an address space (from as_activate) */
+void vm_tlb_activate(struct addrspace *as);
+
+/* Flush an address space's entries from every CPU's TLB */
+void vm_tlb_flush_as(struct addrspace *as);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 int block_read(paddr_t place_on_memory, off_t place_on_disk);
@@ -49,6 +49,7 @@
 #include "opt-synchprobs.h"
 #include "opt-automationtest.h"
 #include <proc_syscall.h>
+#include <vm.h>
 
 /*
  * In-kernel menu and command dispatcher.
@@ -520,6 +521,53 @@ cmd_kheapdump(int nargs, char **args)
     return 0;
 }
 
+static
+int
+cmd_vmfaultstats(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+    
+    vm_printfaultstats();
+    
+    return 0;
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+    (void)nargs;
+    (void)args;
+    
+    vm_printvmstat();
+    
+    return 0;
+}
+
+static
+int
+cmd_vmfaultaround(int nargs, char **args)
+{
+    unsigned pages;
+    
+    if (nargs == 2) {
+        pages = atoi(args[1]);
+        if (pages > 64 || (pages & (pages - 1)) != 0) {
+            kprintf("vmfa: window must be a power of two up to 64\n");
+            return EINVAL;
+        }
+        vm_faultaround = pages;
+    }
+    else if (nargs != 1) {
+        kprintf("Usage: vmfa [pages]\n");
+        return EINVAL;
+    }
+    kprintf("fault-around window: %u pages\n", vm_faultaround);
+    
+    return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -671,6 +719,9 @@ static const char *mainmenu[] = {
     "[khu] Kernel heap usage             ",
     "[khgen] Next kernel heap generation ",
     "[khdump] Dump kernel heap           ",
+    "[vmf] VM fault stats (and reset)    ",
+    "[vmfa] Fault-around window          ",
+    "[vmstat] VM counters (and reset)    ",
     "[q] Quit and shut down              ",
     NULL
 };
@@ -726,6 +777,9 @@ static struct {
     { "khu",        cmd_kheapused },
     { "khgen",      cmd_kheapgeneration },
     { "khdump",     cmd_kheapdump },
+    { "vmf",        cmd_vmfaultstats },
+    { "vmfa",       cmd_vmfaultaround },
+    { "vmstat",     cmd_vmstat },
     
     /* base system tests */
     { "at",		arraytest },
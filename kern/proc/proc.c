@@ -43,9 +43,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
 #include <spl.h>
+#include <membar.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <kern/fcntl.h>
@@ -59,10 +63,246 @@
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
-struct proc *proc_table[250];
-struct lock *proc_table_lock;
-struct lock *buf_lock;
-int pid_counter = PID_MIN;
+
+/*
+ * PIDs. The low PID_SLOT_BITS of a PID pick a slot in the process
+ * table and the bits above count how many times that slot has been
+ * used, so a freed slot doesn't hand out the same PID again straight
+ * away. Free slots are kept on a FIFO list, so reuse is spread over
+ * the whole table. Allocating and freeing are O(1) under pid_lock.
+ *
+ * The table grows a chunk of PROC_CHUNK slots at a time, up to
+ * PROC_SLOTS_MAX, and chunks never move or go away, so lookups take
+ * no lock. Slot 0 is the kernel and slot 1 the process started from
+ * the menu; neither is ever on the free list.
+ */
+#define PID_SLOT_BITS	10
+#define PROC_SLOTS_MAX	(1 << PID_SLOT_BITS)
+#define PROC_CHUNK	32
+#define PID_SLOT(pid)	((pid) & (PROC_SLOTS_MAX - 1))
+#define PID_GEN(pid)	((pid) >> PID_SLOT_BITS)
+#define PID_GENS	((PID_MAX + 1) >> PID_SLOT_BITS)
+
+struct proc_slot {
+    struct proc *ps_proc;	/* or NULL if free */
+    pid_t ps_ppid;		/* ps_proc's parent, or -1 if none */
+    unsigned ps_gen;		/* generation of the current or next PID */
+    int ps_next;		/* free list link */
+};
+
+static struct proc_slot *proc_chunks[PROC_SLOTS_MAX / PROC_CHUNK];
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+static unsigned proc_nslots;
+static int pid_free_head = -1;
+static int pid_free_tail = -1;
+
+#define PROC_SLOT(i)	(&proc_chunks[(i) / PROC_CHUNK][(i) % PROC_CHUNK])
+
+/*
+ * Protects every process's family fields (see struct proc) and
+ * exit_status/exit_code once the process has a parent to report to.
+ * A parent waiting for children sleeps on its own p_waitcv with this
+ * held, and an exiting child broadcasts on its parent's.
+ */
+static struct lock *proc_wait_lock;
+
+/* Put SLOT at the back of the free list. Call with pid_lock held. */
+static
+void
+pid_push(int slot)
+{
+    PROC_SLOT(slot)->ps_next = -1;
+    if(pid_free_tail < 0){
+        pid_free_head = slot;
+    } else {
+        PROC_SLOT(pid_free_tail)->ps_next = slot;
+    }
+    pid_free_tail = slot;
+}
+
+/* Add CHUNK to the table. Call with pid_lock held. */
+static
+void
+pid_grow(struct proc_slot *chunk)
+{
+    int first = proc_nslots;
+    
+    KASSERT(proc_nslots < PROC_SLOTS_MAX);
+    proc_chunks[first / PROC_CHUNK] = chunk;
+    proc_nslots += PROC_CHUNK;
+    for(int i = first; i < first + PROC_CHUNK; i++){
+        PROC_SLOT(i)->ps_proc = NULL;
+        PROC_SLOT(i)->ps_ppid = 0;
+        PROC_SLOT(i)->ps_gen = 0;
+        if(i >= PID_MIN){
+            pid_push(i);
+        }
+    }
+}
+
+/*
+ * Give PROC a PID, with its slot at the given one if SLOT is not -1
+ * (for the kernel and menu processes). PROC's ppid must be set.
+ * Returns ENPROC if the table is full.
+ */
+static
+int
+pid_alloc(struct proc *proc, int slot)
+{
+    struct proc_slot *chunk = NULL;
+    struct proc_slot *ps;
+    
+    spinlock_acquire(&pid_lock);
+    while(proc_nslots == 0 || (slot < 0 && pid_free_head < 0)){
+        if(proc_nslots == PROC_SLOTS_MAX){
+            spinlock_release(&pid_lock);
+            kfree(chunk);
+            return ENPROC;
+        }
+        if(chunk == NULL){
+            /* Someone else may grow the table while we're out. */
+            spinlock_release(&pid_lock);
+            chunk = kmalloc(PROC_CHUNK * sizeof(*chunk));
+            if(chunk == NULL){
+                return ENOMEM;
+            }
+            spinlock_acquire(&pid_lock);
+            continue;
+        }
+        pid_grow(chunk);
+        chunk = NULL;
+    }
+    if(slot < 0){
+        slot = pid_free_head;
+        pid_free_head = PROC_SLOT(slot)->ps_next;
+        if(pid_free_head < 0){
+            pid_free_tail = -1;
+        }
+    }
+    ps = PROC_SLOT(slot);
+    KASSERT(ps->ps_proc == NULL);
+    proc->pid = ps->ps_gen << PID_SLOT_BITS | slot;
+    ps->ps_ppid = proc->ppid;
+    /* Lookups read ps_proc first; make sure the rest is there. */
+    membar_store_store();
+    ps->ps_proc = proc;
+    spinlock_release(&pid_lock);
+    
+    kfree(chunk);
+    return 0;
+}
+
+/* Give back PROC's PID, if it has one. */
+static
+void
+pid_free(struct proc *proc)
+{
+    struct proc_slot *ps;
+    int slot;
+    
+    if(proc->pid < 0){
+        return;
+    }
+    slot = PID_SLOT(proc->pid);
+    
+    spinlock_acquire(&pid_lock);
+    ps = PROC_SLOT(slot);
+    KASSERT(ps->ps_proc == proc);
+    ps->ps_proc = NULL;
+    membar_store_store();
+    if(slot >= PID_MIN){
+        ps->ps_gen = (ps->ps_gen + 1) % PID_GENS;
+        pid_push(slot);
+    }
+    spinlock_release(&pid_lock);
+}
+
+/*
+ * Set the parent PID that proc_getchild checks for PROC: -1 when it
+ * has no parent, so that a process that later gets the old parent's
+ * PID doesn't find it. Call with proc_wait_lock held.
+ */
+static
+void
+pid_setppid(struct proc *proc, pid_t ppid)
+{
+    if(proc->pid < 0){
+        return;
+    }
+    spinlock_acquire(&pid_lock);
+    PROC_SLOT(PID_SLOT(proc->pid))->ps_ppid = ppid;
+    spinlock_release(&pid_lock);
+}
+
+/*
+ * Find the current process's child with PID, without locking. It can
+ * only be freed by us, so it stays put once found. Returns ESRCH if
+ * there is no such process and ECHILD if it isn't our child.
+ */
+int
+proc_getchild(pid_t pid, struct proc **childp)
+{
+    struct proc_slot *chunk, *ps;
+    struct proc *proc;
+    int slot;
+    
+    if(pid < 0 || pid > PID_MAX){
+        return ESRCH;
+    }
+    slot = PID_SLOT(pid);
+    chunk = proc_chunks[slot / PROC_CHUNK];
+    if(chunk == NULL){
+        return ESRCH;
+    }
+    ps = &chunk[slot % PROC_CHUNK];
+    proc = ps->ps_proc;
+    membar_load_load();
+    if(proc == NULL || ps->ps_gen != (unsigned)PID_GEN(pid)){
+        return ESRCH;
+    }
+    if(ps->ps_ppid != curproc->pid){
+        return ECHILD;
+    }
+    *childp = proc;
+    return 0;
+}
+
+/* Add CHILD to the front of LIST. Call with proc_wait_lock held. */
+static
+void
+proc_push(struct proc **list, struct proc *child)
+{
+    child->p_sibprev = NULL;
+    child->p_sibnext = *list;
+    if(*list != NULL){
+        (*list)->p_sibprev = child;
+    }
+    *list = child;
+}
+
+/*
+ * Take CHILD off its parent's p_children or p_zombies, whichever it's
+ * on. Call with proc_wait_lock held.
+ */
+static
+void
+proc_unlink(struct proc *child)
+{
+    struct proc *parent = child->p_parent;
+    
+    if(child->p_sibprev != NULL){
+        child->p_sibprev->p_sibnext = child->p_sibnext;
+    } else if(child->exit_status){
+        parent->p_zombies = child->p_sibnext;
+    } else {
+        parent->p_children = child->p_sibnext;
+    }
+    if(child->p_sibnext != NULL){
+        child->p_sibnext->p_sibprev = child->p_sibprev;
+    }
+    child->p_sibnext = child->p_sibprev = NULL;
+}
+
 /*
  * Create a proc structure.
  */
@@ -99,8 +339,21 @@ proc_create(const char *name)
     proc->ppid = 0;
     proc->exit_status = false;
     proc->exit_code = -1;
-    proc->sem = sem_create("exit_queue", 0);
-    if(proc->sem == NULL){
+    proc->p_release = NULL;
+    proc->p_borrowed = false;
+    proc->p_parent = NULL;
+    proc->p_children = NULL;
+    proc->p_zombies = NULL;
+    proc->p_sibnext = NULL;
+    proc->p_sibprev = NULL;
+    proc->p_uthreads = NULL;
+    proc->p_nexttid = 1;
+    proc->p_nuthreads = 1;
+    proc->p_exiting = false;
+    proc->p_stopper = NULL;
+    proc->p_nstopped = 0;
+    proc->p_waitcv = cv_create("waitpid");
+    if(proc->p_waitcv == NULL){
         //        if(pid_counter != 1){
         //            lock_acquire(proc_table_lock);
         //        }
@@ -108,16 +361,22 @@ proc_create(const char *name)
         kfree(proc);
         return NULL;
     }
+    proc->p_threadcv = cv_create("thread_join");
+    if(proc->p_threadcv == NULL){
+        cv_destroy(proc->p_waitcv);
+        kfree(proc->p_name);
+        kfree(proc);
+        return NULL;
+    }
     proc->lk = lock_create("lock");
     if(proc->lk == NULL){
-        sem_destroy(proc->sem);
+        cv_destroy(proc->p_threadcv);
+        cv_destroy(proc->p_waitcv);
         kfree(proc->p_name);
         kfree(proc);
         return NULL;
     }
     
-    proc_table[proc->pid] = proc;
-    
     return proc;
 }
 
@@ -142,6 +401,15 @@ proc_destroy(struct proc *proc)
     KASSERT(proc != NULL);
     KASSERT(proc != kproc);
     
+    /* A child that never ran, e.g. when fork fails. */
+    if(proc->p_parent != NULL && proc->p_parent != kproc){
+        lock_acquire(proc_wait_lock);
+        proc_unlink(proc);
+        lock_release(proc_wait_lock);
+    }
+    KASSERT(proc->p_children == NULL);
+    KASSERT(proc->p_zombies == NULL);
+    
     /*
      * We don't take p_lock in here because we must have the only
      * reference to this structure. (Otherwise it would be
@@ -211,7 +479,7 @@ proc_destroy(struct proc *proc)
                     vfs_close(proc->file_table[i]->vn);
                     lock_release(proc->file_table[i]->lk);
                     lock_destroy(proc->file_table[i]->lk);
-                    kfree(proc->file_table[i]);
+                    kmem_cache_free(&file_handle_cache, proc->file_table[i]);
                     proc->file_table[i] = NULL;
                 }
             else{
@@ -221,9 +489,11 @@ proc_destroy(struct proc *proc)
     }
     spinlock_cleanup(&proc->p_lock);
     kfree(proc->p_name);
-    sem_destroy(proc->sem);
+    KASSERT(proc->p_uthreads == NULL);
+    cv_destroy(proc->p_threadcv);
+    cv_destroy(proc->p_waitcv);
     lock_destroy(proc->lk);
-    proc_table[proc->pid] = NULL;
+    pid_free(proc);
     kfree(proc);
 }
 
@@ -238,12 +508,14 @@ proc_bootstrap(void)
     if (kproc == NULL) {
         panic("proc_create for kproc failed\n");
     }
-    for(int i = 0; i<250; i++){
-        proc_table[i] = NULL;
+    if (pid_alloc(kproc, 0)) {
+        panic("pid_alloc for kproc failed\n");
     }
-    kproc->pid = 0;
-    proc_table[0] = kproc;
-    buf_lock = lock_create("buf_lock");
+    proc_wait_lock = lock_create("proc_wait");
+    if (proc_wait_lock == NULL) {
+        panic("lock_create for proc_wait_lock failed\n");
+    }
+    futex_bootstrap();
 }
 
 /*
@@ -303,8 +575,13 @@ proc_create_runprogram(const char *name)
         newproc->p_cwd = curproc->p_cwd;
     }
     spinlock_release(&curproc->p_lock);
-    newproc->pid = 1;
-    proc_table[1] = newproc;
+    /* The menu reaps it with proc_destroy, not proc_wait. */
+    newproc->p_parent = kproc;
+    /* The menu waits for each program, so slot 1 is free again. */
+    if (pid_alloc(newproc, 1)) {
+        proc_destroy(newproc);
+        return NULL;
+    }
     
     return newproc;
 }
@@ -408,17 +685,20 @@ proc_setas(struct addrspace *newas)
     return oldas;
 }
 
+struct kmem_cache file_handle_cache =
+    KMEM_CACHE_INITIALIZER("file_handle", sizeof(struct file_handle),
+                           NULL, NULL);
+
 int
 file_handle_init(int fd, struct file_handle *file_table[])
 {
-    file_table[fd] = kmalloc(sizeof(struct file_handle));
+    file_table[fd] = kmem_cache_alloc(&file_handle_cache);
     if(file_table[fd] == NULL){
-        kfree(file_table[fd]);
         return -1;
     }
     file_table[fd]->lk = lock_create("lock");
     if(file_table[fd]->lk == NULL){
-        kfree(file_table[fd]);
+        kmem_cache_free(&file_handle_cache, file_table[fd]);
         file_table[fd] = NULL;
         return -1;
     }
@@ -432,22 +712,27 @@ file_handle_destroy(int fd, struct file_handle *file_table[])
 {
     
     lock_destroy(file_table[fd]->lk);
-    kfree(file_table[fd]);
+    kmem_cache_free(&file_handle_cache, file_table[fd]);
     file_table[fd] = NULL;
 }
 
-struct proc *
-proc_child_create(const char *name)
+int
+proc_child_create(const char *name, bool adopt, struct proc **childp)
 {
     struct proc *child_proc;
+    int result;
+    
     child_proc = proc_create(name);
     if(child_proc == NULL){
-        return NULL;
+        return ENOMEM;
+    }
+    /* Until it is adopted, no process has it as a child. */
+    child_proc->ppid = adopt ? curproc->pid : -1;
+    result = pid_alloc(child_proc, -1);
+    if(result){
+        proc_destroy(child_proc);
+        return result;
     }
-    lock_acquire(proc_table_lock);
-    child_proc->pid = pid_counter++;
-    lock_release(proc_table_lock);
-    child_proc->ppid = curproc->pid;
     for(int i = 0; i < OPEN_MAX; i++){
         child_proc->file_table[i] = curproc->file_table[i];
         if(curproc->file_table[i] != NULL){
@@ -456,6 +741,450 @@ proc_child_create(const char *name)
             lock_release(curproc->file_table[i]->lk);
         }
     }
-   	proc_table[child_proc->pid] = child_proc;
-    return child_proc;
+    
+    if(adopt){
+        proc_adopt(child_proc, curproc);
+    }
+    
+    *childp = child_proc;
+    return 0;
+}
+
+/*
+ * Make CHILD, which has no parent yet, a child of PARENT that PARENT
+ * can wait for. PARENT must not be able to exit meanwhile.
+ */
+void
+proc_adopt(struct proc *child, struct proc *parent)
+{
+    lock_acquire(proc_wait_lock);
+    KASSERT(child->p_parent == NULL);
+    child->p_parent = parent;
+    proc_push(&parent->p_children, child);
+    child->ppid = parent->pid;
+    pid_setppid(child, parent->pid);
+    lock_release(proc_wait_lock);
+}
+
+/*
+ * Exit the current process with wait status STATUS. The address space
+ * goes now; the rest of the proc stays as a zombie on the parent's
+ * list until it is waited for. Our own zombies are reaped here and
+ * our running children are orphaned, so they reap themselves when
+ * they exit. Detaches the current thread, which should call
+ * thread_exit next.
+ */
+void
+proc_exit(int status)
+{
+    struct proc *proc = curproc;
+    struct proc *parent, *child, *zombies;
+    struct addrspace *as;
+    
+    KASSERT(proc != kproc);
+    
+    while(!proc_single(true)){
+        /*
+         * Another thread is exiting or execing the process. If it's
+         * exiting, or the exec works, we don't come back.
+         */
+        proc_checkexit();
+    }
+    
+    as = proc_setas(NULL);
+    if(as != NULL){
+        as_deactivate();
+        as_destroy(as);
+    }
+    proc_remthread(curthread);
+    
+    lock_acquire(proc_wait_lock);
+    for(child = proc->p_children; child != NULL; child = child->p_sibnext){
+        child->p_parent = NULL;
+        pid_setppid(child, -1);
+    }
+    proc->p_children = NULL;
+    zombies = proc->p_zombies;
+    proc->p_zombies = NULL;
+    for(child = zombies; child != NULL; child = child->p_sibnext){
+        child->p_parent = NULL;
+        pid_setppid(child, -1);
+    }
+    
+    parent = proc->p_parent;
+    if(parent != NULL && parent != kproc){
+        proc_unlink(proc);
+    }
+    proc->exit_code = status;
+    proc->exit_status = true;
+    if(parent != NULL && parent != kproc){
+        proc_push(&parent->p_zombies, proc);
+        cv_broadcast(parent->p_waitcv, proc_wait_lock);
+    }
+    lock_release(proc_wait_lock);
+    
+    /* Once the lock is dropped our parent may free us at any time. */
+    while(zombies != NULL){
+        child = zombies;
+        zombies = child->p_sibnext;
+        proc_destroy(child);
+    }
+    if(parent == NULL){
+        /* Nobody left to wait for us. */
+        proc_destroy(proc);
+    }
+}
+
+/*
+ * Wait for the current process's child PID, or any child if PID is
+ * WAIT_ANY, to exit, and free it. Returns its PID and wait status.
+ * With WNOHANG, returns PID 0 straight away if no such child has
+ * exited yet. Returns ECHILD if there are no children to wait for.
+ */
+int
+proc_wait(pid_t pid, int options, pid_t *pidp, int *statusp)
+{
+    struct proc *proc = curproc;
+    struct proc *child;
+    int result;
+    
+    if(options & ~WNOHANG){
+        return EINVAL;
+    }
+    
+    lock_acquire(proc_wait_lock);
+    while(1){
+        if(pid == WAIT_ANY){
+            child = proc->p_zombies;
+            if(child == NULL && proc->p_children == NULL){
+                lock_release(proc_wait_lock);
+                return ECHILD;
+            }
+        } else {
+            /* Look again each time in case another thread reaped it. */
+            result = proc_getchild(pid, &child);
+            if(result){
+                lock_release(proc_wait_lock);
+                return result;
+            }
+            if(!child->exit_status){
+                child = NULL;
+            }
+        }
+        if(child != NULL){
+            break;
+        }
+        if(proc->p_exiting){
+            /* Another thread is exiting; see proc_single. */
+            lock_release(proc_wait_lock);
+            return EINTR;
+        }
+        if(options & WNOHANG){
+            lock_release(proc_wait_lock);
+            *pidp = 0;
+            return 0;
+        }
+        cv_wait(proc->p_waitcv, proc_wait_lock);
+    }
+    
+    proc_unlink(child);
+    child->p_parent = NULL;
+    *pidp = child->pid;
+    *statusp = child->exit_code;
+    /* Free the PID now so nobody else can find it. */
+    pid_free(child);
+    child->pid = -1;
+    lock_release(proc_wait_lock);
+    
+    proc_destroy(child);
+    return 0;
+}
+
+/*
+ * User threads.
+ *
+ * Each thread made by thread_create gets a stack region of its own,
+ * carved out below the mmap regions. When the thread exits its stack
+ * pages are freed at once, since it won't be back in user mode, but
+ * the region and the record are kept for the next thread_create.
+ *
+ * Exiting or execing a process with more than one thread goes through
+ * proc_stop, which sets p_exiting and waits for the other threads to
+ * park in proc_checkexit on their way back to user mode. A thread
+ * spinning in user mode gets there on its next timer interrupt, and
+ * threads asleep in thread_join, waitpid or futex_wait are woken to
+ * do so. proc_single then sends the parked threads off to exit, or,
+ * if an exec fails, proc_restart lets them carry on.
+ */
+
+/* Find the current process's record for T, or NULL. Call with lk held. */
+static
+struct uthread *
+uthread_find(struct thread *t)
+{
+    struct uthread *ut;
+    
+    for(ut = curproc->p_uthreads; ut != NULL; ut = ut->ut_next){
+        if(ut->ut_state == UT_RUNNING && ut->ut_thread == t){
+            break;
+        }
+    }
+    return ut;
+}
+
+int
+proc_thread_create(struct uthread **utp)
+{
+    struct proc *proc = curproc;
+    struct uthread *ut;
+    int result;
+    
+    lock_acquire(proc->lk);
+    if(proc->p_exiting){
+        lock_release(proc->lk);
+        return EINTR;
+    }
+    for(ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next){
+        if(ut->ut_state == UT_FREE){
+            break;
+        }
+    }
+    if(ut == NULL){
+        ut = kmalloc(sizeof(*ut));
+        if(ut == NULL){
+            lock_release(proc->lk);
+            return ENOMEM;
+        }
+        result = as_mmap(proc_getas(), UTHREAD_STACK_SIZE,
+                         REGION_R | REGION_W, 0, NULL, 0, 0, &ut->ut_stack);
+        if(result){
+            lock_release(proc->lk);
+            kfree(ut);
+            return result;
+        }
+        ut->ut_next = proc->p_uthreads;
+        proc->p_uthreads = ut;
+    }
+    ut->ut_tid = proc->p_nexttid++;
+    ut->ut_state = UT_RUNNING;
+    ut->ut_status = 0;
+    ut->ut_joining = false;
+    ut->ut_thread = NULL;
+    proc->p_nuthreads++;
+    lock_release(proc->lk);
+    
+    *utp = ut;
+    return 0;
+}
+
+/* Called by the new thread itself, before it goes to user mode. */
+void
+proc_thread_started(struct uthread *ut)
+{
+    lock_acquire(curproc->lk);
+    ut->ut_thread = curthread;
+    lock_release(curproc->lk);
+}
+
+/* The thread for UT couldn't be started. */
+void
+proc_thread_abort(struct uthread *ut)
+{
+    lock_acquire(curproc->lk);
+    ut->ut_state = UT_FREE;
+    curproc->p_nuthreads--;
+    lock_release(curproc->lk);
+}
+
+/*
+ * Leave the current process without exiting it, as thread UT (NULL
+ * for the first thread, or when the record doesn't matter any more).
+ * Call with lk held. Does not return.
+ */
+static
+void
+uthread_leave(struct uthread *ut, int status)
+{
+    struct proc *proc = curproc;
+    
+    if(ut != NULL){
+        ut->ut_state = UT_EXITED;
+        ut->ut_status = status;
+        ut->ut_thread = NULL;
+    }
+    KASSERT(proc->p_nuthreads > 1);
+    proc->p_nuthreads--;
+    cv_broadcast(proc->p_threadcv, proc->lk);
+    /* Off the proc before the lock goes; it may be freed after that. */
+    proc_remthread(curthread);
+    lock_release(proc->lk);
+    thread_exit();
+}
+
+void
+proc_thread_exit(int status)
+{
+    struct proc *proc = curproc;
+    struct uthread *ut;
+    
+    lock_acquire(proc->lk);
+    if(proc->p_nuthreads == 1){
+        /* Last one; the caller exits the process. */
+        lock_release(proc->lk);
+        return;
+    }
+    ut = uthread_find(curthread);
+    if(ut != NULL){
+        as_discard(proc_getas(), ut->ut_stack, UTHREAD_STACK_SIZE);
+    }
+    uthread_leave(ut, status);
+}
+
+int
+proc_thread_join(int tid, int *statusp)
+{
+    struct proc *proc = curproc;
+    struct uthread *ut;
+    
+    lock_acquire(proc->lk);
+    for(ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next){
+        if(ut->ut_tid == tid && ut->ut_state != UT_FREE){
+            break;
+        }
+    }
+    if(ut == NULL){
+        lock_release(proc->lk);
+        return ESRCH;
+    }
+    if(ut->ut_thread == curthread || ut->ut_joining){
+        lock_release(proc->lk);
+        return EINVAL;
+    }
+    ut->ut_joining = true;
+    while(ut->ut_state == UT_RUNNING && !proc->p_exiting){
+        cv_wait(proc->p_threadcv, proc->lk);
+    }
+    ut->ut_joining = false;
+    if(ut->ut_state == UT_RUNNING){
+        lock_release(proc->lk);
+        return EINTR;
+    }
+    *statusp = ut->ut_status;
+    ut->ut_state = UT_FREE;
+    lock_release(proc->lk);
+    return 0;
+}
+
+/*
+ * Park every other thread in the current process in proc_checkexit,
+ * where it waits to hear whether to go on or exit. Returns false if
+ * another thread has already done this.
+ */
+bool
+proc_stop(void)
+{
+    struct proc *proc = curproc;
+    
+    lock_acquire(proc->lk);
+    if(proc->p_exiting){
+        lock_release(proc->lk);
+        return false;
+    }
+    proc->p_exiting = true;
+    proc->p_stopper = curthread;
+    if(proc->p_nuthreads > 1){
+        cv_broadcast(proc->p_threadcv, proc->lk);
+        lock_release(proc->lk);
+        
+        lock_acquire(proc_wait_lock);
+        cv_broadcast(proc->p_waitcv, proc_wait_lock);
+        lock_release(proc_wait_lock);
+        futex_interrupt(proc_getas());
+        
+        lock_acquire(proc->lk);
+        while(proc->p_nstopped + 1 < proc->p_nuthreads){
+            cv_wait(proc->p_threadcv, proc->lk);
+        }
+    }
+    lock_release(proc->lk);
+    return true;
+}
+
+/*
+ * Undo proc_stop: the other threads go back to user mode. Any that
+ * were asleep in a system call return EINTR from it.
+ */
+void
+proc_restart(void)
+{
+    struct proc *proc = curproc;
+    
+    lock_acquire(proc->lk);
+    KASSERT(proc->p_stopper == curthread);
+    proc->p_exiting = false;
+    proc->p_stopper = NULL;
+    cv_broadcast(proc->p_threadcv, proc->lk);
+    lock_release(proc->lk);
+}
+
+/*
+ * Make the calling thread the only one in the current process,
+ * stopping the others first unless proc_stop already has. The thread
+ * records go too, as exec is about to replace the stacks and exit
+ * doesn't need them. If EXITING, p_exiting stays set so nothing can
+ * start another thread.
+ */
+bool
+proc_single(bool exiting)
+{
+    struct proc *proc = curproc;
+    struct uthread *ut;
+    
+    if(proc->p_stopper != curthread && !proc_stop()){
+        return false;
+    }
+    
+    lock_acquire(proc->lk);
+    /* p_exiting with no stopper tells the parked threads to exit. */
+    proc->p_stopper = NULL;
+    cv_broadcast(proc->p_threadcv, proc->lk);
+    while(proc->p_nuthreads > 1){
+        cv_wait(proc->p_threadcv, proc->lk);
+    }
+    while(proc->p_uthreads != NULL){
+        ut = proc->p_uthreads;
+        proc->p_uthreads = ut->ut_next;
+        kfree(ut);
+    }
+    proc->p_exiting = exiting;
+    lock_release(proc->lk);
+    return true;
+}
+
+void
+proc_checkexit(void)
+{
+    struct proc *proc = curproc;
+    
+    if(proc == NULL || !proc->p_exiting){
+        return;
+    }
+    lock_acquire(proc->lk);
+    if(!proc->p_exiting || proc->p_stopper == curthread ||
+       proc->p_nuthreads == 1){
+        /* We are the thread that set it. */
+        lock_release(proc->lk);
+        return;
+    }
+    proc->p_nstopped++;
+    cv_broadcast(proc->p_threadcv, proc->lk);
+    while(proc->p_exiting && proc->p_stopper != NULL){
+        cv_wait(proc->p_threadcv, proc->lk);
+    }
+    proc->p_nstopped--;
+    if(proc->p_exiting){
+        uthread_leave(NULL, 0);
+    }
+    /* proc_restart: carry on. */
+    lock_release(proc->lk);
 }
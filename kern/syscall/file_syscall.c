@@ -41,7 +41,7 @@ sys_open(const char *filename, int flags, int *retval)
     for (int i=0; i <= OPEN_MAX; i++ ) {
         if(curproc->file_table[i] == NULL){
 //            file_handle_init(i, curproc->file_table);
-            curproc->file_table[i] = kmalloc(sizeof(struct file_handle));
+            curproc->file_table[i] = kmem_cache_alloc(&file_handle_cache);
             if (curproc->file_table[i] == NULL) {
                 kfree(file_name_copy);
                 *retval = ENOMEM;
@@ -49,9 +49,9 @@ sys_open(const char *filename, int flags, int *retval)
             }
             curproc->file_table[i]->lk = lock_create("lock");
             if (curproc->file_table[i]->lk == NULL) {
+                kmem_cache_free(&file_handle_cache, curproc->file_table[i]);
                 curproc->file_table[i] = NULL;
                 kfree(file_name_copy);
-                kfree(curproc->file_table[i]);
                 *retval = ENOMEM;
                 return -1;
             }
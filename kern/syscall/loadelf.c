@@ -34,7 +34,7 @@
  * It makes the following address space calls:
  *    - first, as_define_region once for each segment of the program;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then as_map_file for each chunk of the program;
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -42,8 +42,8 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Executables are memory-mapped: each segment's region is backed by
+ * the file and pages are read in by vm_fault as they are touched.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -69,10 +70,12 @@
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Nothing is read here: the region is just marked as backed by the
+ * file, and vm_fault reads each page the first time it is touched,
+ * zero-filling whatever lies past FILESIZE. Because nothing goes
+ * through uiomove any more, a segment reaching into kernel space has
+ * to be rejected explicitly, and so does a file too short to hold the
+ * segment, which would otherwise only show up as a fault later on.
  */
 static
 int
@@ -81,68 +84,40 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
-	struct iovec iov;
-	struct uio u;
+	struct stat st;
 	int result;
 
+	(void)is_executable;
+
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return ENOEXEC;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
+	if (filesize == 0) {
+		/* Pure bss; zero-fill on demand. */
+		return 0;
+	}
+
+	result = VOP_STAT(v, &st);
 	if (result) {
 		return result;
 	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
+	if (offset < 0 || st.st_size < offset ||
+	    st.st_size - offset < (off_t)filesize) {
+		/* short file; problem with executable? */
 		kprintf("ELF: short read on segment - file truncated?\n");
 		return ENOEXEC;
 	}
 
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
-	return result;
+	return as_map_file(as, vaddr, v, offset, filesize);
 }
 
 /*
@@ -17,25 +17,31 @@
 #include <copyinout.h>
 #include <spl.h>
 #include <mips/tlb.h>
-
-static char buf[ARG_MAX];
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <kern/vmstat.h>
+#include <vnode.h>
+#include <wchan.h>
+#include <file_handle.h>
 
 pid_t
 sys_fork(int *retval, struct trapframe *tf)
 {
 //    lock_acquire(curproc->lk);
     int result;
+    struct proc *child_proc;
     
-    struct proc *child_proc = proc_child_create("child_proc");
-    if(child_proc == NULL){
+    result = proc_child_create("child_proc", true, &child_proc);
+    if(result){
 //        lock_release(curproc->lk);
         *retval = -1;
-        return ENOMEM;
+        return result;
     }
     
     struct trapframe *child_tf = kmalloc(sizeof(*child_tf));
     if(child_tf == NULL){
 //        lock_release(curproc->lk);
+        proc_destroy(child_proc);
         *retval = -1;
         return ENOMEM;
     }
@@ -44,17 +50,11 @@ sys_fork(int *retval, struct trapframe *tf)
     if(result){
 //        lock_release(curproc->lk);
         kfree(child_tf);
+        proc_destroy(child_proc);
         *retval = -1;
         return result;
     }
     
-    if(child_proc->pid == -1){
-//        lock_release(curproc->lk);
-        kfree(child_tf);
-        *retval = -1;
-        return ENPROC;
-    }
-    
     memcpy(child_tf, tf, sizeof(struct trapframe));
     
 //    lock_release(curproc->lk);
@@ -62,6 +62,7 @@ sys_fork(int *retval, struct trapframe *tf)
     result = thread_fork("child_thread" , child_proc, enter_forked_process, child_tf, (unsigned long)NULL);
     if(result){
         kfree(child_tf);
+        proc_destroy(child_proc);
         *retval = -1;
         return result;
     }
@@ -76,46 +77,434 @@ sys_fork(int *retval, struct trapframe *tf)
     return 0;
 }
 
+/*
+ * vfork and spawn. The parent sleeps on the child's p_release until
+ * the child is done with it: a vforked child runs on the parent's
+ * address space until it execs or exits, and a spawned child tells
+ * the parent whether its program loaded. Called on the child's own
+ * thread; does nothing if no parent is waiting.
+ */
+void
+vfork_release(void)
+{
+    struct proc *p = curproc;
+    struct semaphore *sem = p->p_release;
+    
+    if(sem == NULL){
+        return;
+    }
+    if(p->p_borrowed){
+        /* Exiting without exec; the address space stays the parent's. */
+        proc_setas(NULL);
+        as_deactivate();
+        p->p_borrowed = false;
+    }
+    p->p_release = NULL;
+    V(sem);
+}
+
+/* Start a vforked or spawned child; sets the child's cwd first. */
+static
+int
+vfork_start(struct proc *child, void (*entry)(void *, unsigned long),
+            void *data)
+{
+    spinlock_acquire(&curproc->p_lock);
+    if (curproc->p_cwd != NULL) {
+        VOP_INCREF(curproc->p_cwd);
+        child->p_cwd = curproc->p_cwd;
+    }
+    spinlock_release(&curproc->p_lock);
+    
+    return thread_fork(child->p_name, child, entry, data, 0);
+}
+
+/*
+ * Like fork, but instead of copying the address space the child runs
+ * on ours and we sleep until it calls execv or _exit. The child must
+ * not return from the function that called vfork.
+ */
 pid_t
-sys_getpid(int *retval)
+sys_vfork(int *retval, struct trapframe *tf)
 {
-    *retval = curproc->pid;
+    struct proc *child_proc;
+    struct trapframe *child_tf;
+    struct semaphore *release;
+    int result;
+    
+    result = proc_child_create("child_proc", true, &child_proc);
+    if(result){
+        *retval = -1;
+        return result;
+    }
+    child_tf = kmalloc(sizeof(*child_tf));
+    release = sem_create("vfork", 0);
+    if(child_tf == NULL || release == NULL){
+        kfree(child_tf);
+        if(release != NULL){
+            sem_destroy(release);
+        }
+        proc_destroy(child_proc);
+        *retval = -1;
+        return ENOMEM;
+    }
+    memcpy(child_tf, tf, sizeof(struct trapframe));
+    
+    child_proc->p_addrspace = curproc->p_addrspace;
+    child_proc->p_borrowed = true;
+    child_proc->p_release = release;
+    
+    result = vfork_start(child_proc, enter_forked_process, child_tf);
+    if(result){
+        child_proc->p_addrspace = NULL;
+        kfree(child_tf);
+        sem_destroy(release);
+        proc_destroy(child_proc);
+        *retval = -1;
+        return result;
+    }
+    
+    P(release);
+    sem_destroy(release);
+    *retval = child_proc->pid;
     return 0;
 }
 
-pid_t
-sys_waitpid(pid_t pid, int *status, int options, int *retval)
+/*
+ * Program path and arguments copied in for execv and spawn, one set
+ * per call so execs on different CPUs don't wait for each other. The
+ * argument strings are packed one after another, each padded with
+ * NULs to a multiple of 4 bytes, which is how they go on the new user
+ * stack. The buffer starts at a page and doubles as needed, up to
+ * ARG_MAX, so small argument lists stay cheap.
+ */
+struct exec_args {
+    char *ea_path;
+    char *ea_strings;
+    size_t ea_len;		/* bytes of ea_strings in use */
+    size_t ea_size;		/* bytes allocated */
+    int ea_argc;
+};
+
+static
+void
+exec_args_free(struct exec_args *ea)
 {
-//    kprintf("this was called %d\n", pid);
-    if(status == NULL){
-        *retval = pid;
-        return 0;
+    kfree(ea->ea_path);
+    kfree(ea->ea_strings);
+    kfree(ea);
+}
+
+static
+int
+exec_args_grow(struct exec_args *ea)
+{
+    size_t size = ea->ea_size * 2;
+    char *strings;
+    
+    if(ea->ea_size >= ARG_MAX){
+        return E2BIG;
+    }
+    if(size > ARG_MAX){
+        size = ARG_MAX;
+    }
+    strings = kmalloc(size);
+    if(strings == NULL){
+        return ENOMEM;
+    }
+    memcpy(strings, ea->ea_strings, ea->ea_len);
+    kfree(ea->ea_strings);
+    ea->ea_strings = strings;
+    ea->ea_size = size;
+    return 0;
+}
+
+static
+int
+exec_args_copyin(const_userptr_t upath, const_userptr_t uargv,
+                 struct exec_args **eap)
+{
+    struct exec_args *ea;
+    userptr_t uarg;
+    size_t got;
+    int result;
+    
+    ea = kmalloc(sizeof(*ea));
+    if(ea == NULL){
+        return ENOMEM;
+    }
+    ea->ea_size = PAGE_SIZE;
+    ea->ea_len = 0;
+    ea->ea_argc = 0;
+    ea->ea_path = kmalloc(PATH_MAX);
+    ea->ea_strings = kmalloc(ea->ea_size);
+    if(ea->ea_path == NULL || ea->ea_strings == NULL){
+        result = ENOMEM;
+        goto fail;
+    }
+    
+    result = copyinstr(upath, ea->ea_path, PATH_MAX, &got);
+    if(result){
+        goto fail;
+    }
+    
+    while(1){
+        result = copyin((const_userptr_t)((vaddr_t)uargv +
+                                          ea->ea_argc * sizeof(userptr_t)),
+                        &uarg, sizeof(uarg));
+        if(result){
+            goto fail;
+        }
+        if(uarg == NULL){
+            break;
+        }
+        while(1){
+            result = copyinstr(uarg, ea->ea_strings + ea->ea_len,
+                               ea->ea_size - ea->ea_len, &got);
+            if(result != ENAMETOOLONG){
+                break;
+            }
+            result = exec_args_grow(ea);
+            if(result){
+                break;
+            }
+        }
+        if(result){
+            goto fail;
+        }
+        /* ea_size is a multiple of 4, so the padding always fits. */
+        while(got % 4 != 0){
+            ea->ea_strings[ea->ea_len + got++] = '\0';
+        }
+        ea->ea_len += got;
+        ea->ea_argc++;
+        /* The argv array counts against ARG_MAX too. */
+        if(ea->ea_len + (ea->ea_argc + 1) * sizeof(userptr_t) > ARG_MAX){
+            result = E2BIG;
+            goto fail;
+        }
+    }
+    *eap = ea;
+    return 0;
+    
+fail:
+    exec_args_free(ea);
+    return result;
+}
+
+/*
+ * Put the strings and an argv array for them on the new user stack,
+ * below *STACKPTR. Leaves *STACKPTR pointing at argv.
+ */
+static
+int
+exec_args_copyout(struct exec_args *ea, vaddr_t *stackptr)
+{
+    userptr_t *argv;
+    vaddr_t sp = *stackptr;
+    size_t off = 0;
+    int result;
+    
+    argv = kmalloc((ea->ea_argc + 1) * sizeof(userptr_t));
+    if(argv == NULL){
+        return ENOMEM;
+    }
+    sp -= ea->ea_len;
+    for(int i = 0; i < ea->ea_argc; i++){
+        argv[i] = (userptr_t)(sp + off);
+        off += ROUNDUP(strlen(ea->ea_strings + off) + 1, 4);
+    }
+    argv[ea->ea_argc] = NULL;
+    
+    result = copyout(ea->ea_strings, (userptr_t)sp, ea->ea_len);
+    if(result == 0){
+        sp -= (ea->ea_argc + 1) * sizeof(userptr_t);
+        sp &= ~(vaddr_t)7;
+        result = copyout(argv, (userptr_t)sp,
+                         (ea->ea_argc + 1) * sizeof(userptr_t));
+    }
+    kfree(argv);
+    *stackptr = sp;
+    return result;
+}
+
+/*
+ * Give the current process a fresh address space holding the program
+ * at PATH (which vfs_open may modify), and switch to it. On success
+ * the address space it replaced, if any, is returned in *OLDASP for
+ * the caller to dispose of; on failure the old one is still in place.
+ */
+static
+int
+exec_load(char *path, vaddr_t *entrypoint, vaddr_t *stackptr,
+          struct addrspace **oldasp)
+{
+    struct addrspace *new_as, *old_as;
+    struct vnode *v;
+    int result;
+    
+    result = vfs_open(path, O_RDONLY, 0, &v);
+    if(result){
+        return result;
+    }
+    new_as = as_create();
+    if(new_as == NULL){
+        vfs_close(v);
+        return ENOMEM;
     }
+    old_as = proc_setas(new_as);
+    as_activate();
     
-    if(options != 0){
+    result = load_elf(v, entrypoint);
+    vfs_close(v);
+    if(result == 0){
+        result = as_define_stack(new_as, stackptr);
+    }
+    if(result){
+        proc_setas(old_as);
+        as_activate();
+        as_destroy(new_as);
+        return result;
+    }
+    *oldasp = old_as;
+    return 0;
+}
+
+/*
+ * Handed to a spawned child on the parent's stack, which stays put
+ * until the child calls vfork_release.
+ */
+struct spawn_args {
+    struct exec_args *sa_ea;
+    struct proc *sa_parent;
+    int sa_err;			/* set by the child: why it didn't load */
+};
+
+/*
+ * First thing a spawned process runs: load the program and go. Only
+ * once it has loaded does the child become one the parent can wait
+ * for; otherwise it exits as an orphan and reaps itself.
+ */
+static
+void
+spawn_enter(void *data, unsigned long unused)
+{
+    struct spawn_args *sa = data;
+    struct exec_args *ea = sa->sa_ea;
+    struct addrspace *old_as;
+    vaddr_t entrypoint, stackptr;
+    int argc = ea->ea_argc;
+    int result;
+    
+    (void)unused;
+    
+    result = exec_load(ea->ea_path, &entrypoint, &stackptr, &old_as);
+    if(result == 0){
+        KASSERT(old_as == NULL);
+        result = exec_args_copyout(ea, &stackptr);
+    }
+    exec_args_free(ea);
+    
+    if(result == 0){
+        /* The parent is asleep in sys_spawn, so it can't exit. */
+        proc_adopt(curproc, sa->sa_parent);
+    }
+    sa->sa_err = result;
+    vfork_release();
+    if(result){
+        sys_exit(255);
+    }
+    enter_new_process(argc, (userptr_t)stackptr, NULL, stackptr, entrypoint);
+}
+
+/*
+ * Create a process running the program at PATH with arguments ARGV,
+ * without copying or borrowing our address space. The child gets our
+ * open files and current directory, as with fork. Returns once the
+ * program has loaded, or with the error if it couldn't be.
+ */
+int
+sys_spawn(const_userptr_t path, const_userptr_t argv, int *retval)
+{
+    struct exec_args *ea;
+    struct spawn_args sa;
+    struct proc *child_proc;
+    struct semaphore *release;
+    pid_t pid;
+    int result;
+    
+    result = exec_args_copyin(path, argv, &ea);
+    if(result){
         *retval = -1;
-        return EINVAL;
+        return result;
     }
-    if(pid < 0 || pid > 250 || proc_table[pid] == NULL){
+    result = proc_child_create(ea->ea_path, false, &child_proc);
+    if(result){
+        exec_args_free(ea);
         *retval = -1;
-        return ESRCH;
+        return result;
     }
-    
-    if(proc_table[pid]->ppid != curproc->pid){
+    release = sem_create("spawn", 0);
+    if(release == NULL){
+        exec_args_free(ea);
+        proc_destroy(child_proc);
         *retval = -1;
-        return ECHILD;
+        return ENOMEM;
     }
+    child_proc->p_release = release;
+    sa.sa_ea = ea;
+    sa.sa_parent = curproc;
+    sa.sa_err = 0;
+    /* Once it has started the child may go away at any time. */
+    pid = child_proc->pid;
     
-    P(proc_table[pid]->sem);
+    result = vfork_start(child_proc, spawn_enter, &sa);
+    if(result){
+        exec_args_free(ea);
+        sem_destroy(release);
+        proc_destroy(child_proc);
+        *retval = -1;
+        return result;
+    }
     
-    int result = copyout(&proc_table[pid]->exit_code, (userptr_t)status, sizeof(int));
+    P(release);
+    sem_destroy(release);
+    if(sa.sa_err){
+        *retval = -1;
+        return sa.sa_err;
+    }
+    *retval = pid;
+    return 0;
+}
+
+pid_t
+sys_getpid(int *retval)
+{
+    *retval = curproc->pid;
+    return 0;
+}
+
+pid_t
+sys_waitpid(pid_t pid, int *status, int options, int *retval)
+{
+//    kprintf("this was called %d\n", pid);
+    int exitcode;
+    int result = proc_wait(pid, options, &pid, &exitcode);
     if(result){
         *retval = -1;
         return result;
     }
     
+    /* The child has been reaped even if this fails. */
+    if(status != NULL && pid != 0){
+        result = copyout(&exitcode, (userptr_t)status, sizeof(int));
+        if(result){
+            *retval = -1;
+            return result;
+        }
+    }
+    
     *retval = pid;
-    proc_destroy(proc_table[pid]);
 //    for (int i = 0; i<OPEN_MAX; i++){
 //        if(proc_table[pid]->file_table[i] !=NULL){
 //            lock_acquire(proc_table[pid]->file_table[i]->lk);
@@ -143,228 +532,344 @@ sys_waitpid(pid_t pid, int *status, int options, int *retval)
     return 0;
 }
 
+/* First thing a thread made by thread_create runs. */
+static
 void
-sys_exit(int exitcode)
+uthread_enter(void *data1, unsigned long data2)
 {
-//    if(curproc->pid == 1){
-//        int temp = 0;
-//        for(int i=0; i < OPEN_MAX; i++){
-//            sys_close(i, &temp);
-//        }
-//    }
-    curproc->exit_status  = true;
-    curproc->exit_code = _MKWAIT_EXIT(exitcode);
-    V(curproc->sem);
-    thread_exit();
+    struct uthread *ut = (struct uthread *)data2;
     
+    proc_thread_started(ut);
+    enter_new_thread(data1);
 }
 
+/*
+ * Start a new thread in this process, running ENTRY(FUNC, ARG) on a
+ * stack of its own. ENTRY is libc's wrapper, which calls FUNC(ARG)
+ * and passes what it returns to thread_exit. The thread starts with
+ * a copy of our registers, so it gets our gp. Returns its thread id.
+ */
 int
-sys_execv(const char *program, char **args, int *retval)
+sys_thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+                  struct trapframe *tf, int *retval)
 {
-    struct addrspace *new_as = NULL;
-    struct vnode *v;
-    vaddr_t entrypoint, stackptr;
-    int result= 0;
-    char *program_copy;
-    size_t actual = 0;
-    int argc = 0;
-    int padding_size = 0;
-    
-    lock_acquire(buf_lock);
-    
-    // copy arguments from user space to kernel space
-    
-    memset(buf,'\0',ARG_MAX);
+    struct trapframe *child_tf;
+    struct uthread *ut;
+    int tid, result;
     
-    //    program_copy = (char *)kmalloc(sizeof(char)*PATH_MAX);
-    
-    program_copy = kstrdup(program);
-    if (program_copy == NULL) {
-        kfree(program_copy);
-        lock_release(buf_lock);
+    child_tf = kmalloc(sizeof(*child_tf));
+    if(child_tf == NULL){
         *retval = -1;
-        return EFAULT;
+        return ENOMEM;
     }
-    
-    if(copyinstr((const_userptr_t)program, program_copy, PATH_MAX, &actual)){
-        lock_release(buf_lock);
-        kfree(program_copy);
+    result = proc_thread_create(&ut);
+    if(result){
+        kfree(child_tf);
         *retval = -1;
-        return EFAULT;
+        return result;
     }
     
-    void *off = buf;
-    char **start_args = args;
-    
-    void *temp = kmalloc(sizeof(char *));
-    if(temp == NULL){
-        lock_release(buf_lock);
-        kfree(program_copy);
-        *retval = -1;
-        return ENOMEM;
-    }
+    memcpy(child_tf, tf, sizeof(*child_tf));
+    child_tf->tf_epc = (vaddr_t)entry;
+    child_tf->tf_a0 = (vaddr_t)func;
+    child_tf->tf_a1 = (vaddr_t)arg;
+    /* Room at the top for ENTRY to save its argument registers. */
+    child_tf->tf_sp = ut->ut_stack + UTHREAD_STACK_SIZE - 16;
+    /* Once it runs it may exit and be reused before we look again. */
+    tid = ut->ut_tid;
     
-    result = copyin((userptr_t)start_args, temp, sizeof(char *));
+    result = thread_fork(curproc->p_name, curproc, uthread_enter,
+                         child_tf, (unsigned long)ut);
     if(result){
-        lock_release(buf_lock);
-        kfree(program_copy);
-        kfree(temp);
+        kfree(child_tf);
+        proc_thread_abort(ut);
         *retval = -1;
-        return EFAULT;
+        return result;
     }
+    *retval = tid;
+    return 0;
+}
+
+/* Exit this thread; the last one out exits the process with CODE. */
+void
+sys_thread_exit(int code)
+{
+    proc_thread_exit(code);
+    sys_exit(code);
+}
+
+int
+sys_thread_join(int tid, userptr_t status, int *retval)
+{
+    int code;
+    int result;
     
-    while(start_args[argc] != NULL){
-        result = copyin((userptr_t)start_args, temp, sizeof(char *));
-        if(result){
-            lock_release(buf_lock);
-            kfree(program_copy);
-            kfree(temp);
-            *retval = -1;
-            return EFAULT;
+    result = proc_thread_join(tid, &code);
+    if(result == 0 && status != NULL){
+        result = copyout(&code, status, sizeof(int));
+    }
+    *retval = result ? -1 : 0;
+    return result;
+}
+
+/*
+ * Futexes: sleep until woken, keyed on a user address, so user-level
+ * locks only come into the kernel when there's contention. A waiter
+ * sleeps on one of a few wait channels shared by every address that
+ * hashes to the same bucket, with a record on the bucket's list
+ * saying what it waits for. futex_wake takes the records it wants off
+ * the list and wakes the channel; whoever is still on the list goes
+ * back to sleep. The key is the address space and the address, so
+ * only threads of one process (or a vforked child) meet.
+ */
+#define FUTEX_BUCKETS 32
+#define FUTEX_HASH(as, va) \
+    ((((uintptr_t)(as) >> 6) ^ ((va) >> 2)) % FUTEX_BUCKETS)
+
+struct futex_waiter {
+    struct addrspace *fw_as;
+    vaddr_t fw_uaddr;
+    bool fw_woken;
+    int fw_result;			/* what futex_wait returns once woken */
+    struct futex_waiter *fw_next;
+};
+
+static struct futex_bucket {
+    struct spinlock fb_lock;
+    struct wchan *fb_wchan;
+    struct futex_waiter *fb_waiters;	/* oldest first */
+} futex_buckets[FUTEX_BUCKETS];
+
+void
+futex_bootstrap(void)
+{
+    for(int i = 0; i < FUTEX_BUCKETS; i++){
+        spinlock_init(&futex_buckets[i].fb_lock);
+        futex_buckets[i].fb_waiters = NULL;
+        futex_buckets[i].fb_wchan = wchan_create("futex");
+        if(futex_buckets[i].fb_wchan == NULL){
+            panic("futex_bootstrap: out of memory\n");
         }
-        argc++;
     }
-    argc++;
-    
-    void *m = off;
+}
+
+/*
+ * Take the waiters on FB's list that match AS (and UADDR, unless
+ * UADDR is 0) off it, up to N of them or all if N is negative, and
+ * wake them to return RESULT. Call with fb_lock held. Returns how
+ * many there were.
+ */
+static
+int
+futex_wake_bucket(struct futex_bucket *fb, struct addrspace *as,
+                  vaddr_t uaddr, int n, int result)
+{
+    struct futex_waiter *w, **wp;
+    int woken = 0;
     
-    for(int i = 0; i < argc - 1 ; i++){
-        result = copyinstr((const_userptr_t)args[i], off, ARG_MAX, &actual);
-        if(result){
-            lock_release(buf_lock);
-            kfree(program_copy);
-            kfree(temp);
-            *retval = -1;
-            return result;
-        }
-        off += actual;
-        if(actual % 4){
-            padding_size = 4 - (actual % 4);
-            off += padding_size;
+    wp = &fb->fb_waiters;
+    while(*wp != NULL && (n < 0 || woken < n)){
+        w = *wp;
+        if(w->fw_as == as && (uaddr == 0 || w->fw_uaddr == uaddr)){
+            *wp = w->fw_next;
+            w->fw_woken = true;
+            w->fw_result = result;
+            woken++;
+        } else {
+            wp = &w->fw_next;
         }
     }
+    if(woken > 0){
+        wchan_wakeall(fb->fb_wchan, &fb->fb_lock);
+    }
+    return woken;
+}
+
+/* Wake every futex waiter in AS with EINTR; see proc_stop. */
+void
+futex_interrupt(struct addrspace *as)
+{
+    struct futex_bucket *fb;
     
+    for(int i = 0; i < FUTEX_BUCKETS; i++){
+        fb = &futex_buckets[i];
+        spinlock_acquire(&fb->fb_lock);
+        futex_wake_bucket(fb, as, 0, -1, EINTR);
+        spinlock_release(&fb->fb_lock);
+    }
+}
+
+/*
+ * Sleep until futex_wake on UADDR, if the int there is still VAL.
+ * Returns EAGAIN straight away if it isn't, and EINTR if another
+ * thread stops the process. As with any futex, the caller has to
+ * check its condition again after waking.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int val, int *retval)
+{
+    struct futex_waiter w, **wp;
+    struct futex_bucket *fb;
+    int cur, result;
     
-    // load executable into memory
-    result = vfs_open(program_copy, O_RDONLY, 0, &v);
-    if (result) {
-        lock_release(buf_lock);
-        kfree(program_copy);
-        kfree(temp);
+    if(uaddr == NULL){
         *retval = -1;
-        return result;
+        return EFAULT;
     }
-    
-    if(curproc->p_addrspace != NULL){
-        as_destroy(curproc->p_addrspace);
-        curproc->p_addrspace = NULL;
+    if((vaddr_t)uaddr % sizeof(int) != 0){
+        *retval = -1;
+        return EINVAL;
     }
+    w.fw_as = proc_getas();
+    w.fw_uaddr = (vaddr_t)uaddr;
+    w.fw_woken = false;
+    w.fw_result = 0;
+    w.fw_next = NULL;
+    fb = &futex_buckets[FUTEX_HASH(w.fw_as, w.fw_uaddr)];
     
-    KASSERT(curproc->p_addrspace == NULL);
+    /*
+     * Get on the list before looking at the value, so a wake that
+     * follows a change to it can't miss us. The copyin may fault, so
+     * it can't be done with fb_lock held.
+     */
+    spinlock_acquire(&fb->fb_lock);
+    for(wp = &fb->fb_waiters; *wp != NULL; wp = &(*wp)->fw_next);
+    *wp = &w;
+    spinlock_release(&fb->fb_lock);
     
-    new_as = as_create();
-    if (new_as == NULL) {
-        vfs_close(v);
-        kfree(program_copy);
-        kfree(temp);
-        lock_release(buf_lock);
-        *retval = -1;
-        return ENOMEM;
+    result = copyin(uaddr, &cur, sizeof(int));
+    if(result == 0 && cur != val){
+        result = EAGAIN;
     }
     
-    curproc->p_addrspace = new_as;
-    as_activate();
+    spinlock_acquire(&fb->fb_lock);
+    if(result == 0 && curproc->p_exiting){
+        /* futex_interrupt may have been and gone. */
+        result = EINTR;
+    }
+    if(result == 0){
+        while(!w.fw_woken){
+            wchan_sleep(fb->fb_wchan, &fb->fb_lock);
+        }
+        result = w.fw_result;
+    } else if(w.fw_woken){
+        /* Somebody's wake went to us; don't lose it. */
+        result = w.fw_result;
+    } else {
+        for(wp = &fb->fb_waiters; *wp != &w; wp = &(*wp)->fw_next);
+        *wp = w.fw_next;
+    }
+    spinlock_release(&fb->fb_lock);
     
-    result = load_elf(v, &entrypoint);
-    if (result) {
-        vfs_close(v);
-        kfree(program_copy);
-        kfree(temp);
-        lock_release(buf_lock);
+    *retval = result ? -1 : 0;
+    return result;
+}
+
+/* Wake up to N threads in futex_wait on UADDR; returns how many. */
+int
+sys_futex_wake(userptr_t uaddr, int n, int *retval)
+{
+    struct futex_bucket *fb;
+    struct addrspace *as;
+    
+    if(uaddr == NULL){
         *retval = -1;
-        return result;
+        return EFAULT;
     }
+    if((vaddr_t)uaddr % sizeof(int) != 0 || n < 0){
+        *retval = -1;
+        return EINVAL;
+    }
+    as = proc_getas();
+    fb = &futex_buckets[FUTEX_HASH(as, (vaddr_t)uaddr)];
     
-    vfs_close(v);
+    spinlock_acquire(&fb->fb_lock);
+    *retval = futex_wake_bucket(fb, as, (vaddr_t)uaddr, n, 0);
+    spinlock_release(&fb->fb_lock);
+    return 0;
+}
+
+void
+sys_exit(int exitcode)
+{
+//    if(curproc->pid == 1){
+//        int temp = 0;
+//        for(int i=0; i < OPEN_MAX; i++){
+//            sys_close(i, &temp);
+//        }
+//    }
+    vfork_release();
+    proc_exit(_MKWAIT_EXIT(exitcode));
+    thread_exit();
+    
+}
+
+int
+sys_execv(const char *program, char **args, int *retval)
+{
+    struct exec_args *ea;
+    struct addrspace *old_as;
+    vaddr_t entrypoint, stackptr;
+    int argc;
+    int result;
     
-    result = as_define_stack(new_as, &stackptr);
-    if (result) {
-        kfree(program_copy);
-        kfree(temp);
-        lock_release(buf_lock);
+    result = exec_args_copyin((const_userptr_t)program, (const_userptr_t)args,
+                              &ea);
+    if(result){
         *retval = -1;
         return result;
     }
     
-    // copy arguments from kernel to userspace
-    
-    char **argv = kmalloc(argc * sizeof(char *));
-    void *start_argv = argv;
-    //        void *temp = NULL;
-    argv[argc-1] = NULL;
-    
-    int counter = 0;
-    int n = 0;
-    int point = 0;
-    for(int i = 0; i < ARG_MAX; i++){
-        counter++;
-        if(buf[i] == '\0'){
-            if(counter % 4){
-                n = 4 - (counter % 4);
-                counter += n;
-            }
-            stackptr -= counter;
-            argv[point] = (char *)stackptr;
-            copyout(m, (userptr_t)stackptr, counter);
-            m += counter;
-            i += n;
-            point++;
-            counter = 0;
-            n = 0;
-            if(buf[i+1] == '\0'){
-                break;
-            }
-        }
+    /*
+     * Our other threads mustn't run while the image is replaced. They
+     * wait parked until we know whether it worked, and carry on in the
+     * old image if it didn't.
+     */
+    if(!proc_stop()){
+        /* Someone else is exiting or execing the process. */
+        exec_args_free(ea);
+        *retval = -1;
+        return EINTR;
     }
     
-    stackptr -= argc * 4;
-    argv = start_argv;
+    result = exec_load(ea->ea_path, &entrypoint, &stackptr, &old_as);
+    if(result){
+        proc_restart();
+        exec_args_free(ea);
+        *retval = -1;
+        return result;
+    }
     
-    result = copyout(argv, (userptr_t)stackptr, argc * 4);
+    argc = ea->ea_argc;
+    result = exec_args_copyout(ea, &stackptr);
+    exec_args_free(ea);
     if(result){
-        kfree(program_copy);
-        kfree(temp);
-        kfree(argv);
-        lock_release(buf_lock);
+        /* Back to the old image; the new one is no use without args. */
+        as_destroy(proc_setas(old_as));
+        as_activate();
+        proc_restart();
         *retval = -1;
         return result;
     }
-    kfree(program_copy);
-    kfree(temp);
-    kfree(argv);
-    lock_release(buf_lock);
     
-    enter_new_process(argc-1, (userptr_t)stackptr, NULL, stackptr, entrypoint);
+    /* Nothing can fail now, so the other threads can go. */
+    proc_single(false);
+    
+    if(curproc->p_borrowed){
+        /* vforked; the old address space was only lent to us. */
+        curproc->p_borrowed = false;
+        vfork_release();
+    }
+    else if(old_as != NULL){
+        as_destroy(old_as);
+    }
+    
+    enter_new_process(argc, (userptr_t)stackptr, NULL, stackptr, entrypoint);
     
     *retval = 0;
     return 0;
 }
 
-pid_t
-next_available_pid(void)
-{
-    lock_acquire(proc_table_lock);
-    for(int i= PID_MIN; i<128; i++){
-        if(proc_table[i] == NULL){
-            lock_release(proc_table_lock);
-            return i;
-        }
-    }
-    lock_release(proc_table_lock);
-    return -1;
-}
-
 int
 sys_sbrk(intptr_t amount, int * retval){
     
@@ -373,13 +878,16 @@ sys_sbrk(intptr_t amount, int * retval){
         return EINVAL;
     }
     struct addrspace * as = proc_getas();
+    lock_acquire(as->as_lock);
     vaddr_t old = as->heap_end;
     if(amount == 0){
+        lock_release(as->as_lock);
         *retval = old;
         return 0;
     }
     else if(amount > 0){
-        if(as->heap_end + amount >= (USERSTACK - (1024 * PAGE_SIZE))){
+        if(as->heap_end + amount >= as->mmap_base){
+            lock_release(as->as_lock);
             *retval = -1;
             return ENOMEM;
         }
@@ -393,36 +901,26 @@ sys_sbrk(intptr_t amount, int * retval){
             current = next;
         }
         as->heap_end += amount;
+        lock_release(as->as_lock);
         *retval = old;
         return 0;
     }
     else{
         if(as->heap_end + amount < as->heap_start || amount == -4096*1024*256){
+            lock_release(as->as_lock);
             *retval = -1;
             return EINVAL;
         }
         int size = (amount / PAGE_SIZE);
         //-------------------------------------------------------------------------------------------------------------------------------
-        struct page_table_entry * current = as->ptbase;
-        struct page_table_entry * next;
-        struct page_table_entry * prev = NULL;
-        while(current != NULL){
-            next = current->next;
-            if(current->vpn > (as->heap_end + amount) && current->vpn < old){
-                free_kpages(PADDR_TO_KVADDR(current->ppn));
-                lock_destroy(current->lk);
-                kfree(current);
-                if(prev != NULL){
-                    prev->next = next;
-                }
-                else{
-                    as->ptbase = next;
-                }
-            }
-            else{
-                prev = current;
+        for(vaddr_t va = as->heap_end + amount; va < old; va += PAGE_SIZE){
+            struct page_table_entry *pte = pt_remove(as, va);
+            if(pte != NULL){
+                pte_lock(pte);
+                vm_tlb_invalidate(va, pte);
+                pte_unlock(pte);
+                pte_release(pte);
             }
-            current = next;
         }
         //-------------------------------------------------------------------------------------------------------------------------------
         struct region * current1 = as->rbase;
@@ -435,9 +933,117 @@ sys_sbrk(intptr_t amount, int * retval){
             current1 = next1;
         }
         as->heap_end += (size * PAGE_SIZE);
+        lock_release(as->as_lock);
         as_activate();
         *retval = old;
         return 0;
     }
     return EINVAL;
 }
+
+/*
+ * mmap: map LEN bytes of file FD starting at OFFSET. The address hint
+ * is ignored; mappings are placed below the stack, growing down
+ * toward the heap. Pages are read by vm_fault when first touched.
+ */
+int
+sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset,
+         int *retval)
+{
+    struct file_handle *fh;
+    struct stat st;
+    struct addrspace *as = proc_getas();
+    size_t filesize;
+    vaddr_t va;
+    int perm, result;
+    
+    (void)addr;
+    *retval = (int)MAP_FAILED;
+    
+    if(len == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+       (flags != MAP_SHARED && flags != MAP_PRIVATE)){
+        return EINVAL;
+    }
+    if(fd < 0 || fd >= OPEN_MAX || curproc->file_table[fd] == NULL){
+        return EBADF;
+    }
+    fh = curproc->file_table[fd];
+    /* type 1 is write-only, type 2 read-only; see sys_open */
+    if(fh->type == 1 ||
+       (fh->type == 2 && flags == MAP_SHARED && (prot & PROT_WRITE))){
+        return EACCES;
+    }
+    
+    result = VOP_MMAP(fh->vn);
+    if(result){
+        return result;
+    }
+    result = VOP_STAT(fh->vn, &st);
+    if(result){
+        return result;
+    }
+    filesize = 0;
+    if(st.st_size > offset){
+        filesize = len;
+        if(st.st_size - offset < (off_t)len){
+            filesize = st.st_size - offset;
+        }
+    }
+    
+    perm = ((prot & PROT_READ) ? REGION_R : 0) |
+           ((prot & PROT_WRITE) ? REGION_W : 0) |
+           ((prot & PROT_EXEC) ? REGION_X : 0);
+    result = as_mmap(as, len, perm,
+                     flags == MAP_SHARED ? REGION_SHARED : 0,
+                     fh->vn, offset, filesize, &va);
+    if(result){
+        return result;
+    }
+    *retval = va;
+    return 0;
+}
+
+int
+sys_munmap(void *addr, size_t len, int *retval)
+{
+    int result;
+    
+    if((vaddr_t)addr % PAGE_SIZE != 0){
+        *retval = -1;
+        return EINVAL;
+    }
+    result = as_munmap(proc_getas(), (vaddr_t)addr, len);
+    *retval = result ? -1 : 0;
+    return result;
+}
+
+int
+sys_msync(void *addr, size_t len, int flags, int *retval)
+{
+    int result;
+    
+    if((vaddr_t)addr % PAGE_SIZE != 0 ||
+       (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0){
+        *retval = -1;
+        return EINVAL;
+    }
+    result = as_msync(proc_getas(), (vaddr_t)addr, len);
+    *retval = result ? -1 : 0;
+    return result;
+}
+
+int
+sys_vmstat(userptr_t buf, int flags, int *retval)
+{
+    struct vmstat vs;
+    int result;
+    
+    if((flags & ~VMSTAT_RESET) != 0){
+        *retval = -1;
+        return EINVAL;
+    }
+    vm_getstats(&vs, (flags & VMSTAT_RESET) != 0);
+    result = copyout(&vs, buf, sizeof(vs));
+    *retval = result ? -1 : 0;
+    return result;
+}
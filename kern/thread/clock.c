@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <vm.h>
 
 /*
  * Time handling.
@@ -52,6 +53,7 @@
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define VMSAMPLE_HARDCLOCKS	8	/* Sample TLB reference bits every 8. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -103,6 +105,9 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
+	if ((curcpu->c_hardclocks % VMSAMPLE_HARDCLOCKS) == 0) {
+		vm_tlb_sample();
+	}
 	thread_yield();
 }
 
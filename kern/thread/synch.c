@@ -40,6 +40,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -139,19 +140,23 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/* Every PTE and file handle has one, so they come from a cache. */
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), NULL, NULL);
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(*lock));
+	lock = kmem_cache_alloc(&lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		kmem_cache_free(&lock_cache, lock);
 		return NULL;
 	}
 
@@ -160,7 +165,7 @@ lock_create(const char *name)
 	lock->lock_wchan = wchan_create(lock->lk_name);
         if (lock->lock_wchan == NULL) {
                 kfree(lock->lk_name);
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
 	spinlock_init(&lock->lock_spin);
@@ -178,7 +183,7 @@ lock_destroy(struct lock *lock)
 	spinlock_cleanup(&lock->lock_spin);
 	wchan_destroy(lock->lock_wchan);
 	kfree(lock->lk_name);
-	kfree(lock);
+	kmem_cache_free(&lock_cache, lock);
 }
 
 void
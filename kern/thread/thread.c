@@ -50,11 +50,16 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Thread structures come from an object cache. */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), NULL, NULL);
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -129,7 +134,7 @@ thread_create(const char *name)
 		return NULL;
 	}
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
@@ -286,7 +291,7 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -662,7 +667,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Zero a free frame for vm_fault if there's one to do. */
+			if (!vm_prezero()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -810,8 +818,13 @@ thread_exit(void)
 	/*
 	 * Detach from our process. You might need to move this action
 	 * around, depending on how your wait/exit works.
+	 *
+	 * proc_exit has already done it for user processes, as the
+	 * proc may be gone by now.
 	 */
-	proc_remthread(cur);
+	if (cur->t_proc != NULL) {
+		proc_remthread(cur);
+	}
 
 	/* Make sure we *are* detached (move this only if you're sure!) */
 	KASSERT(cur->t_proc == NULL);
@@ -1193,6 +1206,28 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown to every CPU other than this one whose bit is
+ * set in CPUMASK.
+ */
+unsigned
+ipi_tlbshootdown_mask(uint32_t cpumask, const struct tlbshootdown *mapping)
+{
+	unsigned i, sent;
+	struct cpu *c;
+
+	sent = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    (cpumask & ((uint32_t)1 << c->c_number))) {
+			ipi_tlbshootdown(c, mapping);
+			sent++;
+		}
+	}
+	return sent;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -31,16 +31,106 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <spl.h>
+#include <membar.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
 #include <mips/tlb.h>
 #include <synch.h>
+#include <wchan.h>
 #include <bitmap.h>
+#include <vnode.h>
+#include <uio.h>
+#include <kern/stat.h>
+#include <kmem.h>
 
 struct lock *bitmap_lock;
 //static char buffer[PAGE_SIZE];
 
+/*
+ * PTE locks. A PTE is locked by setting its busy bit; anyone who finds
+ * it set sleeps on one of a few wait channels shared by every PTE that
+ * hashes to the same bucket, and pte_unlock wakes the bucket only if
+ * somebody said they were waiting. The bucket spinlock is only held
+ * long enough to test and set the bits.
+ */
+#define PTE_LOCK_BUCKETS 32
+#define PTE_LOCK_HASH(pte) \
+    ((((uintptr_t)(pte) >> 5) ^ ((uintptr_t)(pte) >> 12)) % PTE_LOCK_BUCKETS)
+
+static struct pte_lock_bucket {
+    struct spinlock plb_lock;
+    struct wchan *plb_wchan;
+} pte_lock_buckets[PTE_LOCK_BUCKETS];
+
+void
+pte_lock_bootstrap(void)
+{
+    for(int i = 0; i < PTE_LOCK_BUCKETS; i++){
+        spinlock_init(&pte_lock_buckets[i].plb_lock);
+        pte_lock_buckets[i].plb_wchan = wchan_create("pte");
+        if(pte_lock_buckets[i].plb_wchan == NULL){
+            panic("pte_lock_bootstrap: out of memory\n");
+        }
+    }
+}
+
+void
+pte_lock(struct page_table_entry *pte)
+{
+    struct pte_lock_bucket *b = &pte_lock_buckets[PTE_LOCK_HASH(pte)];
+    
+    spinlock_acquire(&b->plb_lock);
+    while(pte->busy){
+        pte->wanted = true;
+        wchan_sleep(b->plb_wchan, &b->plb_lock);
+    }
+    pte->busy = true;
+    spinlock_release(&b->plb_lock);
+}
+
+void
+pte_unlock(struct page_table_entry *pte)
+{
+    struct pte_lock_bucket *b = &pte_lock_buckets[PTE_LOCK_HASH(pte)];
+    
+    spinlock_acquire(&b->plb_lock);
+    KASSERT(pte->busy);
+    pte->busy = false;
+    if(pte->wanted){
+        /* Shared channel; whoever wasn't waiting for us goes back to sleep. */
+        pte->wanted = false;
+        wchan_wakeall(b->plb_wchan, &b->plb_lock);
+    }
+    spinlock_release(&b->plb_lock);
+}
+
+/* Source of as_ids; 0 means no address space. */
+static struct spinlock as_id_lock = SPINLOCK_INITIALIZER;
+static unsigned as_next_id = 1;
+
+/*
+ * PTEs and regions come from object caches. A PTE is always freed
+ * unlocked, so the only thing the constructor has to set up is the
+ * busy bit.
+ */
+static
+int
+pte_ctor(void *obj)
+{
+    struct page_table_entry *pte = obj;
+    
+    pte->busy = false;
+    pte->wanted = false;
+    return 0;
+}
+
+struct kmem_cache pte_cache =
+    KMEM_CACHE_INITIALIZER("pte", sizeof(struct page_table_entry),
+                           pte_ctor, NULL);
+static struct kmem_cache region_cache =
+    KMEM_CACHE_INITIALIZER("region", sizeof(struct region), NULL, NULL);
+
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -58,14 +148,269 @@ as_create(void)
         return NULL;
     }
     
+    as->pt_dir = kmalloc(PT_L1_SIZE * sizeof(struct page_table_entry **));
+    if (as->pt_dir == NULL) {
+        kfree(as);
+        return NULL;
+    }
+    as->as_lock = lock_create("as");
+    if (as->as_lock == NULL) {
+        kfree(as->pt_dir);
+        kfree(as);
+        return NULL;
+    }
+    for (unsigned i = 0; i < PT_L1_SIZE; i++) {
+        as->pt_dir[i] = NULL;
+    }
+    for (int i = 0; i < STLB_SIZE; i++) {
+        as->as_stlb[i].se_pte = NULL;
+    }
+    as->as_stlb_seq = 0;
+    
     as->heap_start = 0;
     as->heap_end = 0;
     as->rbase = NULL;
-    as->ptbase = NULL;
+    as->as_resident = 0;
+    as->mmap_base = USERSTACK - 1024 * PAGE_SIZE;
+    
+    spinlock_acquire(&as_id_lock);
+    as->as_id = as_next_id++;
+    spinlock_release(&as_id_lock);
     
     return as;
 }
 
+struct page_table_entry *
+pt_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+    struct page_table_entry **l2;
+    
+    if (vaddr >= USERSPACETOP) {
+        return NULL;
+    }
+    l2 = as->pt_dir[PT_L1_INDEX(vaddr)];
+    if (l2 == NULL) {
+        return NULL;
+    }
+    return l2[PT_L2_INDEX(vaddr)];
+}
+
+int
+pt_insert(struct addrspace *as, vaddr_t vaddr, struct page_table_entry *pte)
+{
+    struct page_table_entry **l2;
+    
+    KASSERT(vaddr < USERSPACETOP);
+    
+    l2 = as->pt_dir[PT_L1_INDEX(vaddr)];
+    if (l2 == NULL) {
+        l2 = kmalloc(PT_L2_SIZE * sizeof(struct page_table_entry *));
+        if (l2 == NULL) {
+            return ENOMEM;
+        }
+        for (int i = 0; i < PT_L2_SIZE; i++) {
+            l2[i] = NULL;
+        }
+        as->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+    }
+    KASSERT(l2[PT_L2_INDEX(vaddr)] == NULL);
+    l2[PT_L2_INDEX(vaddr)] = pte;
+    return 0;
+}
+
+struct page_table_entry *
+pt_remove(struct addrspace *as, vaddr_t vaddr)
+{
+    struct page_table_entry **l2;
+    struct page_table_entry *pte;
+    
+    if (vaddr >= USERSPACETOP) {
+        return NULL;
+    }
+    l2 = as->pt_dir[PT_L1_INDEX(vaddr)];
+    if (l2 == NULL) {
+        return NULL;
+    }
+    pte = l2[PT_L2_INDEX(vaddr)];
+    l2[PT_L2_INDEX(vaddr)] = NULL;
+    if (as->as_stlb[STLB_INDEX(vaddr)].se_vaddr == vaddr) {
+        as->as_stlb_seq++;
+        membar_store_store();
+        as->as_stlb[STLB_INDEX(vaddr)].se_pte = NULL;
+        membar_store_store();
+        as->as_stlb_seq++;
+    }
+    return pte;
+}
+
+/*
+ * Vnode page cache. vpage_lock is taken before any PTE lock.
+ */
+struct vpage {
+    struct vnode *vp_vnode;
+    off_t vp_offset;
+    struct page_table_entry *vp_pte;
+    struct vpage *vp_next;
+};
+
+#define VPAGE_BUCKETS 64
+#define VPAGE_HASH(v, off) \
+    ((((uintptr_t)(v) >> 4) ^ (unsigned)((off) / PAGE_SIZE)) % VPAGE_BUCKETS)
+
+static struct vpage *vpage_table[VPAGE_BUCKETS];
+static struct lock *vpage_lock;
+
+void
+vpage_bootstrap(void)
+{
+    vpage_lock = lock_create("vpage_lock");
+    if(vpage_lock == NULL){
+        panic("vpage_bootstrap: out of memory\n");
+    }
+}
+
+struct page_table_entry *
+vpage_lookup(struct vnode *v, off_t offset)
+{
+    struct vpage *vp;
+    struct page_table_entry *pte = NULL;
+    
+    lock_acquire(vpage_lock);
+    for(vp = vpage_table[VPAGE_HASH(v, offset)]; vp != NULL; vp = vp->vp_next){
+        if(vp->vp_vnode == v && vp->vp_offset == offset){
+            pte = vp->vp_pte;
+            pte_lock(pte);
+            KASSERT(pte->refcount > 0);
+            pte->refcount++;
+            pte_unlock(pte);
+            break;
+        }
+    }
+    lock_release(vpage_lock);
+    return pte;
+}
+
+void
+vpage_insert(struct vnode *v, off_t offset, struct page_table_entry *pte)
+{
+    struct vpage *vp, **head;
+    
+    lock_acquire(vpage_lock);
+    head = &vpage_table[VPAGE_HASH(v, offset)];
+    for(vp = *head; vp != NULL; vp = vp->vp_next){
+        if(vp->vp_vnode == v && vp->vp_offset == offset){
+            /* Lost a race with another fault on the same page. */
+            lock_release(vpage_lock);
+            return;
+        }
+    }
+    vp = kmalloc(sizeof(struct vpage));
+    if(vp != NULL){
+        vp->vp_vnode = v;
+        vp->vp_offset = offset;
+        vp->vp_pte = pte;
+        vp->vp_next = *head;
+        *head = vp;
+        pte->vpage = vp;
+    }
+    lock_release(vpage_lock);
+}
+
+int
+vpage_writeback(struct page_table_entry *pte)
+{
+    struct vpage *vp = pte->vpage;
+    struct stat st;
+    struct iovec iov;
+    struct uio u;
+    size_t len;
+    int result;
+    
+    KASSERT(vp != NULL && pte->state == false);
+    
+    /* Don't extend the file with the zero tail of its last page. */
+    result = VOP_STAT(vp->vp_vnode, &st);
+    if(result){
+        return result;
+    }
+    if(st.st_size <= vp->vp_offset){
+        return 0;
+    }
+    len = PAGE_SIZE;
+    if(st.st_size - vp->vp_offset < PAGE_SIZE){
+        len = st.st_size - vp->vp_offset;
+    }
+    uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(pte->ppn), len,
+              vp->vp_offset, UIO_WRITE);
+    return VOP_WRITE(vp->vp_vnode, &u);
+}
+
+/* Call with vpage_lock held. */
+static
+void
+vpage_remove(struct vpage *vp)
+{
+    struct vpage **pp;
+    
+    pp = &vpage_table[VPAGE_HASH(vp->vp_vnode, vp->vp_offset)];
+    while(*pp != vp){
+        KASSERT(*pp != NULL);
+        pp = &(*pp)->vp_next;
+    }
+    *pp = vp->vp_next;
+    kfree(vp);
+}
+
+void
+pte_release(struct page_table_entry *pte)
+{
+    /*
+     * vpage is only set while we (or whoever else has a reference)
+     * keep the PTE alive, so it is safe to look at before locking.
+     */
+    bool cached = pte->vpage != NULL;
+    
+    if(cached){
+        lock_acquire(vpage_lock);
+    }
+    pte_lock(pte);
+    KASSERT(pte->refcount > 0);
+    pte->refcount--;
+    if(pte->refcount > 0){
+        /* Still mapped copy-on-write by another address space. */
+        pte_unlock(pte);
+        if(cached){
+            lock_release(vpage_lock);
+        }
+        return;
+    }
+    if(cached){
+        if(pte->state == false && pte->dirty){
+            /* Last MAP_SHARED mapping gone; nowhere else to keep it. */
+            vpage_writeback(pte);
+        }
+        vpage_remove(pte->vpage);
+        pte->vpage = NULL;
+        lock_release(vpage_lock);
+    }
+    if(swapping_enabled == true && pte->offset != -1){
+        lock_acquire(bitmap_lock);
+        bitmap_unmark(disk, pte->offset/PAGE_SIZE);
+        lock_release(bitmap_lock);
+        pte->offset = -1;
+    }
+    if(pte->state == false){
+        if(!vm_frame_claim(pte->ppn)){
+            /* vm_evict picked the frame and is waiting for the PTE. */
+            pte_unlock(pte);
+            return;
+        }
+        free_kpages(PADDR_TO_KVADDR(pte->ppn));
+    }
+    pte_unlock(pte);
+    kmem_cache_free(&pte_cache, pte);
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -80,135 +425,36 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     int i = 0;
     int result;
     
+    /* Other threads of ours must not fault while we copy. */
+    lock_acquire(old->as_lock);
     newas->heap_start = old->heap_start;
     newas->heap_end = old->heap_end;
+    newas->mmap_base = old->mmap_base;
     
-    struct page_table_entry *current = old->ptbase;
-    struct page_table_entry *last;
-    last = NULL;
-    while(current != NULL){
-        struct page_table_entry *new;
-        new = kmalloc(sizeof(struct page_table_entry));
-        if(new == NULL){
-            as_destroy(newas);
-            return ENOMEM;
-        }
-        new->lk = lock_create("swapping lock");
-        if(new->lk == NULL){
-            return ENOMEM;
-        }
-        
-        new->vpn = current->vpn;
-        if(swapping_enabled == true){
-            lock_acquire(current->lk);
-            lock_acquire(new->lk);
-            if(current->state == true){
-                paddr_t temp_page = getppages(1,3,new);
-                if(temp_page == 0){
-                    return ENOMEM;
-                }
-                block_read(temp_page, current->offset);
-                unsigned int place_on_disk = 0;
-                lock_acquire(bitmap_lock);
-                result = bitmap_alloc(disk,&place_on_disk);
-                if (result) {
-                    lock_release(bitmap_lock);
-                    lock_release(new->lk);
-                    return result;
-                }
-                lock_release(bitmap_lock);
-                block_write(temp_page, place_on_disk*PAGE_SIZE);
-                new->state = true;
-                new->offset = place_on_disk*PAGE_SIZE;
-                new->next = NULL;
-                if(i == 0){
-                    newas->ptbase = new;
-                }
-                else{
-                    last->next = new;
-                }
-                last = new;
-                free_kpages(PADDR_TO_KVADDR(temp_page));
-                lock_release(current->lk);
-                current = current->next;
-                i++;
-//                spinlock_acquire(&coremap_spinlock);
-//                coremap[temp_page/PAGE_SIZE].page_status = 0;
-//                spinlock_release(&coremap_spinlock);
-            } else {
-                spinlock_acquire(&coremap_spinlock);
-                coremap[current->ppn/PAGE_SIZE].page_status = 3;
-                spinlock_release(&coremap_spinlock);
-                unsigned int place_on_disk = 0;
-                lock_acquire(bitmap_lock);
-                result = bitmap_alloc(disk,&place_on_disk);
-                if (result) {
-                    return result;
-                }
-                lock_release(bitmap_lock);
-                block_write(current->ppn, place_on_disk*PAGE_SIZE);
-                new->state = true;
-                new->offset = place_on_disk*PAGE_SIZE;
-                new->next = NULL;
-                if(i == 0){
-                    newas->ptbase = new;
-                }
-                else{
-                    last->next = new;
-                }
-                last = new;
-                lock_release(current->lk);
-                spinlock_acquire(&coremap_spinlock);
-                coremap[current->ppn/PAGE_SIZE].page_status = 2;
-                spinlock_release(&coremap_spinlock);
-                current = current->next;
-                i++;
-            }
-            lock_release(new->lk);
-            
-        }
-        else{
-            new->vpn = current->vpn;
-            lock_acquire(new->lk);
-            new->ppn = getppages(1,3, new);
-            if(new->ppn == 0){
-                as_destroy(newas);
-                return ENOMEM;
-            }
-            memmove((void *)PADDR_TO_KVADDR(new->ppn),
-                    (const void *)PADDR_TO_KVADDR(current->ppn),
-                    PAGE_SIZE);
-            new->state = current->state;
-            new->offset = current->offset;
-            lock_release(new->lk);
-            new->next = NULL;
-            if(i == 0){
-                newas->ptbase = new;
-            }
-            else{
-                last->next = new;
-            }
-            last = new;
-            current = current->next;
-            i++;
-        }
-    }
-    
-    i = 0;
+    /* Regions first, so as_destroy can clean up a partial copy. */
     struct region * current1 = old->rbase;
     struct region * last1;
     last1 = NULL;
     while(current1 != NULL){
         struct region * new1;
-        new1 = kmalloc(sizeof(struct region));
+        new1 = kmem_cache_alloc(&region_cache);
         if(new1 == NULL){
+            lock_release(old->as_lock);
             as_destroy(newas);
             return ENOMEM;
         }
         new1->region_start_address = current1->region_start_address;
         new1->region_size = current1->region_size;
         new1->region_permission = current1->region_permission;
-        new1->next = current1->next;
+        new1->region_vnode = current1->region_vnode;
+        new1->region_fileoffset = current1->region_fileoffset;
+        new1->region_filestart = current1->region_filestart;
+        new1->region_filesize = current1->region_filesize;
+        new1->region_flags = current1->region_flags;
+        if(new1->region_vnode != NULL){
+            VOP_INCREF(new1->region_vnode);
+        }
+        new1->next = NULL;
         if(i==0){
             newas->rbase = new1;
         }
@@ -220,6 +466,43 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         i++;
     }
     
+    /*
+     * Share every page with the child copy-on-write. Both address
+     * spaces point at the same PTE; whichever writes first gets its
+     * own copy in vm_fault. Swapped-out pages are shared the same
+     * way, so fork does no disk I/O at all.
+     */
+    for(unsigned l1 = 0; l1 < PT_L1_SIZE; l1++){
+        if(old->pt_dir[l1] == NULL){
+            continue;
+        }
+        for(int l2 = 0; l2 < PT_L2_SIZE; l2++){
+            struct page_table_entry *current = old->pt_dir[l1][l2];
+            if(current == NULL){
+                continue;
+            }
+            pte_lock(current);
+            current->refcount++;
+            pte_unlock(current);
+            result = pt_insert(newas, (vaddr_t)l1 << 22 | (vaddr_t)l2 << 12,
+                               current);
+            if(result){
+                pte_release(current);
+                lock_release(old->as_lock);
+                as_destroy(newas);
+                return result;
+            }
+        }
+    }
+    
+    /*
+     * The parent may still have writable TLB entries for pages that
+     * are now shared, here or on any CPU that ran it last; drop them
+     * so its next write faults.
+     */
+    vm_tlb_flush_as(old);
+    lock_release(old->as_lock);
+    
     *ret = newas;
     return 0;
 }
@@ -227,46 +510,36 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-    //    (void)as;
-    //    return;
-    struct page_table_entry * current_page_table = as->ptbase;
-    struct page_table_entry *next_page_table;
-    
-    
-    if(swapping_enabled == true){
-        while(current_page_table != NULL){
-            lock_acquire(current_page_table->lk);
-            if(current_page_table->state == true){
-                bitmap_unmark(disk, current_page_table->offset/PAGE_SIZE);
-            } else {
-//                coremap[current_page_table->ppn/PAGE_SIZE].page_status = 3;
-                free_kpages(PADDR_TO_KVADDR(current_page_table->ppn));
-            }
-            lock_release(current_page_table->lk);
-            lock_destroy(current_page_table->lk);
-            next_page_table = current_page_table->next;
-            kfree(current_page_table);
-            current_page_table = next_page_table;
+    for(unsigned l1 = 0; l1 < PT_L1_SIZE; l1++){
+        if(as->pt_dir[l1] == NULL){
+            continue;
         }
-    } else {
-        while(current_page_table != NULL){
-            next_page_table = current_page_table->next;
-            free_kpages(PADDR_TO_KVADDR(current_page_table->ppn));
-            lock_destroy(current_page_table->lk);
-            kfree(current_page_table);
-            current_page_table = next_page_table;
+        for(int l2 = 0; l2 < PT_L2_SIZE; l2++){
+            if(as->pt_dir[l1][l2] != NULL){
+                pte_release(as->pt_dir[l1][l2]);
+            }
         }
+        kfree(as->pt_dir[l1]);
     }
+    kfree(as->pt_dir);
+    /*
+     * Freeing a frame clears its owner, so this only has frames still
+     * shared with other address spaces, or held by the evictor, left.
+     */
+    vm_disown(as);
     
     struct region * current_region = as->rbase;
     struct region * next_region;
     
     while(current_region != NULL){
         next_region = current_region->next;
-        kfree(current_region);
+        if(current_region->region_vnode != NULL){
+            VOP_DECREF(current_region->region_vnode);
+        }
+        kmem_cache_free(&region_cache, current_region);
         current_region = next_region;
     }
-    //    }
+    lock_destroy(as->as_lock);
     kfree(as);
     
 }
@@ -275,22 +548,20 @@ void
 as_activate(void)
 {
     
-    int i, spl;
     struct addrspace *as;
     
     as = proc_getas();
     if (as == NULL) {
+        /* Kernel thread; leave the last process's entries in place. */
         return;
     }
     
-    /* Disable interrupts on this CPU while frobbing the TLB. */
-    spl = splhigh();
-    
-    for (i=0; i<NUM_TLB; i++) {
-        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-    }
-    
-    splx(spl);
+    /*
+     * The TLB is only flushed if it holds some other address space's
+     * entries. as_ids are never reused, so a new address space at a
+     * recycled kmalloc address still gets a flush.
+     */
+    vm_tlb_activate(as);
 }
 
 void
@@ -331,7 +602,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
     
     struct region *new_head;
     
-    new_head = kmalloc(sizeof(struct region));
+    new_head = kmem_cache_alloc(&region_cache);
     if (new_head == NULL) {
         return ENOMEM;
     }
@@ -343,18 +614,173 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
     new_head->region_start_address = vaddr;
     //    kprintf("This is the end address : %x \n",vaddr + memsize);
     new_head->region_size = npages * PAGE_SIZE;;
+    new_head->region_permission = (readable ? REGION_R : 0) |
+                                  (writeable ? REGION_W : 0) |
+                                  (executable ? REGION_X : 0);
+    new_head->region_vnode = NULL;
+    new_head->region_flags = 0;
     new_head->next = head;
     as->rbase = new_head;
     
     as->heap_start = as->rbase->region_start_address + memsize;
     as->heap_end = as->heap_start;
     
-    (void)readable;
-    (void)writeable;
-    (void)executable;
     return 0;
 }
 
+int
+as_map_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+            off_t offset, size_t filesize)
+{
+    struct region *r;
+    
+    for(r = as->rbase; r != NULL; r = r->next){
+        if((vaddr & PAGE_FRAME) == r->region_start_address){
+            break;
+        }
+    }
+    if(r == NULL || r->region_vnode != NULL ||
+       vaddr + filesize > r->region_start_address + r->region_size){
+        return EINVAL;
+    }
+    
+    VOP_INCREF(v);
+    r->region_vnode = v;
+    r->region_fileoffset = offset;
+    r->region_filestart = vaddr;
+    r->region_filesize = filesize;
+    return 0;
+}
+
+int
+as_mmap(struct addrspace *as, size_t len, int perm, int flags,
+        struct vnode *v, off_t offset, size_t filesize, vaddr_t *ret)
+{
+    struct region *r;
+    vaddr_t vaddr;
+    
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    lock_acquire(as->as_lock);
+    if(len == 0 || len > as->mmap_base || as->mmap_base - len < as->heap_end){
+        lock_release(as->as_lock);
+        return ENOMEM;
+    }
+    vaddr = as->mmap_base - len;
+    
+    r = kmem_cache_alloc(&region_cache);
+    if(r == NULL){
+        lock_release(as->as_lock);
+        return ENOMEM;
+    }
+    if(v != NULL){
+        VOP_INCREF(v);
+    }
+    r->region_start_address = vaddr;
+    r->region_size = len;
+    r->region_permission = perm;
+    r->region_vnode = v;
+    r->region_fileoffset = offset;
+    r->region_filestart = vaddr;
+    r->region_filesize = filesize;
+    r->region_flags = flags | REGION_MAPPED;
+    r->next = as->rbase;
+    as->rbase = r;
+    as->mmap_base = vaddr;
+    lock_release(as->as_lock);
+    
+    *ret = vaddr;
+    return 0;
+}
+
+/* Unmap and release the pages in a range. Call with as_lock held. */
+static
+void
+as_drop_pages(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct page_table_entry *pte;
+    
+    for(vaddr_t va = vaddr; va < vaddr + len; va += PAGE_SIZE){
+        pte = pt_remove(as, va);
+        if(pte != NULL){
+            pte_lock(pte);
+            vm_tlb_invalidate(va, pte);
+            pte_unlock(pte);
+            pte_release(pte);
+        }
+    }
+}
+
+void
+as_discard(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    lock_acquire(as->as_lock);
+    as_drop_pages(as, vaddr, len);
+    lock_release(as->as_lock);
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct region *r, **rp;
+    
+    len = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+    lock_acquire(as->as_lock);
+    for(rp = &as->rbase; *rp != NULL; rp = &(*rp)->next){
+        if((*rp)->region_start_address == vaddr){
+            break;
+        }
+    }
+    r = *rp;
+    /* Only whole mappings; splitting regions isn't supported. */
+    if(r == NULL || !(r->region_flags & REGION_MAPPED) ||
+       (size_t)r->region_size != len){
+        lock_release(as->as_lock);
+        return EINVAL;
+    }
+    
+    as_drop_pages(as, vaddr, len);
+    
+    *rp = r->next;
+    if(vaddr == as->mmap_base){
+        as->mmap_base += len;
+    }
+    lock_release(as->as_lock);
+    if(r->region_vnode != NULL){
+        VOP_DECREF(r->region_vnode);
+    }
+    kmem_cache_free(&region_cache, r);
+    return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct page_table_entry *pte;
+    int result = 0, err;
+    
+    lock_acquire(as->as_lock);
+    for(vaddr_t va = vaddr & PAGE_FRAME; va < vaddr + len; va += PAGE_SIZE){
+        pte = pt_lookup(as, va);
+        if(pte == NULL){
+            continue;
+        }
+        pte_lock(pte);
+        if(pte->vpage != NULL && pte->state == false && pte->dirty){
+            /* Make it read-only again so the next store re-dirties it. */
+            vm_tlb_invalidate(va, pte);
+            err = vpage_writeback(pte);
+            if(err){
+                result = err;
+            } else {
+                pte->dirty = false;
+            }
+        }
+        pte_unlock(pte);
+    }
+    lock_release(as->as_lock);
+    return result;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -373,7 +799,7 @@ as_complete_load(struct addrspace *as)
      * Write this.
      */
     
-    struct region *new_head = kmalloc(sizeof(struct region));
+    struct region *new_head = kmem_cache_alloc(&region_cache);
     if(new_head == NULL){
         as_destroy(as);
         return ENOMEM;
@@ -382,6 +808,9 @@ as_complete_load(struct addrspace *as)
     head = as->rbase;
     new_head->region_start_address = as->heap_start;
     new_head->region_size = 0;
+    new_head->region_permission = REGION_R | REGION_W;
+    new_head->region_vnode = NULL;
+    new_head->region_flags = 0;
     new_head->next = head;
     as->rbase = new_head; //this is for initializing the heap whenever we want to.
     
@@ -399,7 +828,7 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
     
     struct region *new_head;
     
-    new_head = kmalloc(sizeof(struct region));
+    new_head = kmem_cache_alloc(&region_cache);
     if (new_head == NULL) {
         return ENOMEM;
     }
@@ -408,6 +837,9 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
     head = as->rbase;
     new_head->region_start_address = USERSTACK - 1024 * PAGE_SIZE;
     new_head->region_size = 1024 * PAGE_SIZE;
+    new_head->region_permission = REGION_R | REGION_W;
+    new_head->region_vnode = NULL;
+    new_head->region_flags = 0;
     new_head->next = head;
     as->rbase = new_head;
     //
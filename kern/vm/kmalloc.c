@@ -29,7 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <kmem.h>
 #include <vm.h>
 #include <kern/test161.h>
 #include <test.h>
@@ -740,6 +745,467 @@ kheap_dumpall(void)
 #endif
 }
 
+////////////////////////////////////////
+//
+// Object caches. See kmem.h.
+
+/*
+ * A slab is one page; this header sits at the start of it and the
+ * object slots follow. Free slots are linked through a pointer at
+ * kc_linkoff in each slot: the start of the slot, unless the cache
+ * has a constructor, in which case it goes after the object so the
+ * constructed state survives.
+ */
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;
+	struct kmem_slab *ks_prev;
+	void *ks_free;
+	unsigned ks_inuse;
+};
+
+#define KMEM_ALIGN 8
+#define KMEM_ROUNDUP(x) (((x) + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1))
+#define KMEM_FIRSTSLOT KMEM_ROUNDUP(sizeof(struct kmem_slab))
+#define KMEM_LINK(kc, obj) ((void **)((char *)(obj) + (kc)->kc_linkoff))
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+kmem_slab_push(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+kmem_slab_unlink(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+}
+
+/*
+ * Work out the slot layout and put the cache on the list for the
+ * stats. Done when the first slab is made, so statically defined
+ * caches need no setup call.
+ */
+static
+void
+kmem_cache_setup(struct kmem_cache *kc)
+{
+	size_t slot;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_perslab == 0) {
+		if (kc->kc_ctor != NULL) {
+			kc->kc_linkoff = KMEM_ROUNDUP(kc->kc_size);
+			slot = kc->kc_linkoff + sizeof(void *);
+		}
+		else {
+			kc->kc_linkoff = 0;
+			slot = kc->kc_size < sizeof(void *) ?
+				sizeof(void *) : kc->kc_size;
+		}
+		kc->kc_slotsize = KMEM_ROUNDUP(slot);
+		kc->kc_perslab = (PAGE_SIZE - KMEM_FIRSTSLOT) / kc->kc_slotsize;
+		KASSERT(kc->kc_perslab > 0);
+	}
+	spinlock_release(&kc->kc_lock);
+
+	spinlock_acquire(&kmem_caches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
+/*
+ * Run the destructor on every object of a slab and give its page
+ * back. Call without kc_lock.
+ */
+static
+void
+kmem_slab_release(struct kmem_cache *kc, struct kmem_slab *ks, unsigned nobjs)
+{
+	vaddr_t page = (vaddr_t)ks;
+	unsigned i;
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<nobjs; i++) {
+			kc->kc_dtor((void *)(page + KMEM_FIRSTSLOT +
+					     i * kc->kc_slotsize));
+		}
+	}
+	free_kpages(page);
+}
+
+/*
+ * Make a new slab and add it to the cache. Called without kc_lock,
+ * since alloc_kpages may have to wait for a page.
+ */
+static
+int
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page, obj;
+	unsigned i;
+	int result;
+
+	if (kc->kc_perslab == 0) {
+		kmem_cache_setup(kc);
+	}
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return ENOMEM;
+	}
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_inuse = 0;
+	ks->ks_free = NULL;
+
+	for (i=0; i<kc->kc_perslab; i++) {
+		obj = page + KMEM_FIRSTSLOT + i * kc->kc_slotsize;
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor((void *)obj);
+			if (result) {
+				kmem_slab_release(kc, ks, i);
+				return result;
+			}
+		}
+	}
+	/* Link them in reverse so they get handed out in address order. */
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		obj = page + KMEM_FIRSTSLOT + i * kc->kc_slotsize;
+		*KMEM_LINK(kc, obj) = ks->ks_free;
+		ks->ks_free = (void *)obj;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kmem_slab_push(&kc->kc_partial, ks);
+	kc->kc_nslabs++;
+	kc->kc_nempty++;
+	spinlock_release(&kc->kc_lock);
+	return 0;
+}
+
+/*
+ * Take up to N objects from the slabs, making a slab if there are
+ * none free. Returns how many it got; 0 means out of memory.
+ */
+static
+unsigned
+kmem_slab_get(struct kmem_cache *kc, void **objs, unsigned n)
+{
+	struct kmem_slab *ks;
+	unsigned got = 0;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL) {
+		spinlock_release(&kc->kc_lock);
+		if (kmem_slab_create(kc)) {
+			return 0;
+		}
+		spinlock_acquire(&kc->kc_lock);
+	}
+	while (got < n && (ks = kc->kc_partial) != NULL) {
+		if (ks->ks_inuse == 0) {
+			kc->kc_nempty--;
+		}
+		while (got < n && ks->ks_free != NULL) {
+			objs[got] = ks->ks_free;
+			ks->ks_free = *KMEM_LINK(kc, objs[got]);
+			ks->ks_inuse++;
+			got++;
+		}
+		if (ks->ks_free == NULL) {
+			kmem_slab_unlink(&kc->kc_partial, ks);
+			kmem_slab_push(&kc->kc_full, ks);
+		}
+	}
+	kc->kc_inuse += got;
+	spinlock_release(&kc->kc_lock);
+	return got;
+}
+
+/*
+ * Give N objects back to their slabs. One empty slab per cache is
+ * kept around; any others go back to the VM.
+ */
+static
+void
+kmem_slab_put(struct kmem_cache *kc, void **objs, unsigned n)
+{
+	struct kmem_slab *ks, *release = NULL;
+	unsigned i;
+
+	spinlock_acquire(&kc->kc_lock);
+	for (i=0; i<n; i++) {
+		ks = (struct kmem_slab *)((vaddr_t)objs[i] & PAGE_FRAME);
+		KASSERT(ks->ks_cache == kc);
+		KASSERT(ks->ks_inuse > 0);
+		if (ks->ks_free == NULL) {
+			kmem_slab_unlink(&kc->kc_full, ks);
+			kmem_slab_push(&kc->kc_partial, ks);
+		}
+		*KMEM_LINK(kc, objs[i]) = ks->ks_free;
+		ks->ks_free = objs[i];
+		ks->ks_inuse--;
+		if (ks->ks_inuse == 0) {
+			if (kc->kc_nempty > 0) {
+				kmem_slab_unlink(&kc->kc_partial, ks);
+				kc->kc_nslabs--;
+				/* Chain it through ks_next; it's off the lists now. */
+				ks->ks_next = release;
+				release = ks;
+			}
+			else {
+				kc->kc_nempty++;
+			}
+		}
+	}
+	kc->kc_inuse -= n;
+	spinlock_release(&kc->kc_lock);
+
+	while (release != NULL) {
+		ks = release;
+		release = ks->ks_next;
+		kmem_slab_release(kc, ks, kc->kc_perslab);
+	}
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned i;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_slotsize = 0;
+	kc->kc_linkoff = 0;
+	kc->kc_perslab = 0;
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_inuse = 0;
+	kc->kc_listed = false;
+	kc->kc_next = NULL;
+	for (i=0; i<MAXCPUS; i++) {
+		kc->kc_mag[i].km_count = 0;
+	}
+	kmem_cache_setup(kc);
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		kmem_slab_put(kc, kc->kc_mag[i].km_objs,
+			      kc->kc_mag[i].km_count);
+		kc->kc_mag[i].km_count = 0;
+	}
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_full == NULL);
+	KASSERT(kc->kc_nslabs <= 1);
+	if (kc->kc_partial != NULL) {
+		kmem_slab_release(kc, kc->kc_partial, kc->kc_perslab);
+	}
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != NULL; kcp = &(*kcp)->kc_next) {
+		if (*kcp == kc) {
+			*kcp = kc->kc_next;
+			break;
+		}
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag;
+	void *objs[KMEM_MAGAZINE / 2];
+	void *obj = NULL;
+	unsigned n;
+	int spl;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &kc->kc_mag[curcpu->c_number];
+		if (mag->km_count > 0) {
+			obj = mag->km_objs[--mag->km_count];
+		}
+		splx(spl);
+		if (obj != NULL) {
+			return obj;
+		}
+	}
+
+	/* Magazine empty; refill half of it from the slabs. */
+	n = kmem_slab_get(kc, objs, CURCPU_EXISTS() ? ARRAYCOUNT(objs) : 1);
+	if (n == 0) {
+		return NULL;
+	}
+	obj = objs[--n];
+	if (n > 0) {
+		/* We may have moved CPUs; fill whichever magazine is ours now. */
+		spl = splhigh();
+		mag = &kc->kc_mag[curcpu->c_number];
+		while (n > 0 && mag->km_count < KMEM_MAGAZINE) {
+			mag->km_objs[mag->km_count++] = objs[--n];
+		}
+		splx(spl);
+		if (n > 0) {
+			kmem_slab_put(kc, objs, n);
+		}
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_magazine *mag;
+	void *objs[KMEM_MAGAZINE / 2];
+	unsigned n = 0;
+	int spl;
+
+	if (obj == NULL) {
+		return;
+	}
+	KASSERT(((struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME))->ks_cache
+		== kc);
+
+	if (!CURCPU_EXISTS()) {
+		kmem_slab_put(kc, &obj, 1);
+		return;
+	}
+
+	spl = splhigh();
+	mag = &kc->kc_mag[curcpu->c_number];
+	if (mag->km_count == KMEM_MAGAZINE) {
+		/* Full; send the older half back to the slabs. */
+		n = ARRAYCOUNT(objs);
+		memcpy(objs, mag->km_objs, n * sizeof(void *));
+		memmove(mag->km_objs, mag->km_objs + n,
+			(KMEM_MAGAZINE - n) * sizeof(void *));
+		mag->km_count -= n;
+	}
+	mag->km_objs[mag->km_count++] = obj;
+	splx(spl);
+
+	if (n > 0) {
+		kmem_slab_put(kc, objs, n);
+	}
+}
+
+/*
+ * Bytes of cache objects actually in use (not sitting free in a slab
+ * or a magazine), and how many pages the slabs take up.
+ */
+static
+unsigned
+kmem_magazined(struct kmem_cache *kc)
+{
+	unsigned i, n = 0;
+
+	/* Other CPUs' counts can be stale; this is only for the stats. */
+	for (i=0; i<MAXCPUS; i++) {
+		n += kc->kc_mag[i].km_count;
+	}
+	return n;
+}
+
+/* Objects handed out to callers. Call with kc_lock held. */
+static
+unsigned
+kmem_inuse(struct kmem_cache *kc)
+{
+	unsigned cached = kmem_magazined(kc);
+
+	return cached < kc->kc_inuse ? kc->kc_inuse - cached : 0;
+}
+
+static
+unsigned long
+kmem_getused(unsigned *slabpages)
+{
+	struct kmem_cache *kc;
+	unsigned long total = 0;
+	unsigned inuse;
+
+	*slabpages = 0;
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		inuse = kmem_inuse(kc);
+		*slabpages += kc->kc_nslabs;
+		spinlock_release(&kc->kc_lock);
+		total += (unsigned long)inuse * kc->kc_size;
+	}
+	spinlock_release(&kmem_caches_lock);
+	return total;
+}
+
+static
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("  %-12s size %-4lu  %u slabs of %u, "
+			"%u in use, %u in magazines\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_nslabs, kc->kc_perslab,
+			kmem_inuse(kc), kmem_magazined(kc));
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
 ////////////////////////////////////////
 
 /*
@@ -818,6 +1284,8 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_printstats();
 }
 
 
@@ -829,7 +1297,7 @@ unsigned long
 kheap_getused(void) {
 	struct pageref *pr;
 	unsigned long total = 0;
-	unsigned int num_pages = 0, coremap_bytes = 0;
+	unsigned int num_pages = 0, coremap_bytes = 0, slab_pages;
 
 	/* compute with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -838,6 +1306,10 @@ kheap_getused(void) {
 		num_pages++;
 	}
 
+	/* Likewise for object cache slabs. */
+	total += kmem_getused(&slab_pages);
+	num_pages += slab_pages;
+
 	coremap_bytes = coremap_used_bytes();
 
 	// Don't double-count the pages we're using for subpage allocation;
@@ -421,11 +421,15 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
+	/*
+	 * The child borrows our memory until it execs, so it does
+	 * nothing but exec and report failure.
+	 */
+	pid = vfork();
 	switch (pid) {
 		case -1:
 			/* error */
-			warn("fork");
+			warn("vfork");
 			exitinfo_exit(ei, 255);
 			return;
 		case 0:
@@ -0,0 +1,96 @@
+/*
+ * vmstat - print virtual memory statistics
+ * usage: vmstat [-z]
+ *        vmstat command [args...]
+ *
+ * With no command, prints the kernel's VM counters since boot (or
+ * since they were last reset); -z resets them afterwards. With a
+ * command, runs it and prints what happened while it ran: the event
+ * counts are the difference between a sample taken before the fork
+ * and one taken after the command exits, so anything else running at
+ * the same time is counted too.
+ *
+ * This program uses these system calls:
+ *    __vmstat fork execv waitpid write _exit
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static
+void
+show(const struct vmstat *vs, const struct vmstat *base)
+{
+	struct vmstat zero;
+
+	if (base == NULL) {
+		memset(&zero, 0, sizeof(zero));
+		base = &zero;
+	}
+
+	printf("frames: %u total, %u free (lowest %u), %u cached, %u cpus\n",
+	       vs->vs_frames, vs->vs_free, vs->vs_free_min, vs->vs_cached,
+	       vs->vs_ncpus);
+	printf("tlb misses:     %10llu\n",
+	       vs->vs_tlb_misses - base->vs_tlb_misses);
+	printf("  soft refills: %10llu\n",
+	       vs->vs_stlb_refills - base->vs_stlb_refills);
+	printf("ro faults:      %10llu\n",
+	       vs->vs_tlb_modifies - base->vs_tlb_modifies);
+	printf("frame allocs:   %10llu\n",
+	       vs->vs_page_allocs - base->vs_page_allocs);
+	printf("clock scans:    %10llu\n",
+	       vs->vs_scans - base->vs_scans);
+	printf("evictions:      %10llu\n",
+	       vs->vs_evictions - base->vs_evictions);
+	printf("swap-ins:       %10llu pages in %llu reads\n",
+	       vs->vs_swapins - base->vs_swapins,
+	       vs->vs_swap_reads - base->vs_swap_reads);
+	printf("swap-outs:      %10llu pages in %llu writes\n",
+	       vs->vs_swapouts - base->vs_swapouts,
+	       vs->vs_swap_writes - base->vs_swap_writes);
+}
+
+static
+void
+sample(struct vmstat *vs, int flags)
+{
+	if (__vmstat(vs, flags) < 0) {
+		err(1, "__vmstat");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vmstat before, after;
+	int status;
+	pid_t pid;
+
+	if (argc == 1 || (argc == 2 && !strcmp(argv[1], "-z"))) {
+		sample(&after, argc == 2 ? VMSTAT_RESET : 0);
+		show(&after, NULL);
+		return 0;
+	}
+	if (argv[1][0] == '-') {
+		errx(1, "Usage: vmstat [-z] | vmstat command [args...]");
+	}
+
+	sample(&before, 0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv(argv[1], argv + 1);
+		err(1, "%s", argv[1]);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	sample(&after, 0);
+	show(&after, &before);
+	return 0;
+}
@@ -39,11 +39,13 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
 #include <kern/unistd.h>
+#include <kern/vmstat.h>
 #include <kern/wait.h>
 //#include <kern/open.h>
 
@@ -142,6 +144,10 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(__intptr_t change);
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
@@ -149,6 +155,20 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+int __vmstat(struct vmstat *buf, int flags);
+/* The child may only call execv or _exit; see sh for an example. */
+pid_t vfork(void);
+/* Start PROG with ARGS in a new process; returns its pid. */
+pid_t spawn(const char *prog, char *const *args);
+int __thread_create(void (*entry)(int (*)(void *), void *),
+		    int (*func)(void *), void *arg);
+/* Exit the calling thread; the last thread exits the process. */
+__DEAD void thread_exit(int code);
+int thread_join(int tid, int *code);
+/* Sleep while *ADDR is VAL, until futex_wake; EAGAIN if it isn't. */
+int futex_wait(volatile int *addr, int val);
+/* Wake up to N threads in futex_wait on ADDR; returns how many. */
+int futex_wake(volatile int *addr, int n);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -157,6 +177,8 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+/* Run FUNC(ARG) in a new thread; returns its id for thread_join. */
+int thread_create(int (*func)(void *), void *arg); /* calls __thread_create */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
 
@@ -0,0 +1,21 @@
+#include <unistd.h>
+
+/*
+ * User threads. The kernel starts a new thread at thread_start with
+ * the function and argument in the first two argument registers, on
+ * a stack of its own; returning from FUNC is the same as calling
+ * thread_exit with what it returned.
+ */
+
+static
+void
+thread_start(int (*func)(void *), void *arg)
+{
+	thread_exit(func(arg));
+}
+
+int
+thread_create(int (*func)(void *), void *arg)
+{
+	return __thread_create(thread_start, func, arg);
+}
@@ -0,0 +1,109 @@
+/*
+ * execbench - measure exec latency
+ * usage: execbench [nprocs [nexecs]]
+ *
+ * Forks NPROCS workers (default 4), each of which execs this program
+ * NEXECS times in a row (default 50), passing the remaining count
+ * along in its arguments, and reports how long the whole lot took.
+ * With more than one worker the execs run side by side, so the time
+ * per exec only stays flat if the kernel lets execs on different CPUs
+ * proceed in parallel.
+ *
+ * A few extra arguments are passed on every exec so argument copying
+ * is part of what gets measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PROG		"/testbin/execbench"
+#define MAXPROCS	32
+
+/* Worker: exec ourselves again until the count runs out. */
+static
+void
+chain(int left)
+{
+	char countbuf[16];
+	char *args[8];
+
+	if (left <= 0) {
+		_exit(0);
+	}
+	snprintf(countbuf, sizeof(countbuf), "%d", left - 1);
+	args[0] = (char *)PROG;
+	args[1] = (char *)"-c";
+	args[2] = countbuf;
+	args[3] = (char *)"padding-argument-one";
+	args[4] = (char *)"padding-argument-two";
+	args[5] = (char *)"padding-argument-three";
+	args[6] = NULL;
+	execv(PROG, args);
+	err(1, "%s", PROG);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nprocs = 4, nexecs = 50;
+	pid_t pids[MAXPROCS];
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long long nsecs, total;
+	int i, status, failed = 0;
+
+	if (argc >= 3 && !strcmp(argv[1], "-c")) {
+		chain(atoi(argv[2]));
+	}
+
+	if (argc > 1) {
+		nprocs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nexecs = atoi(argv[2]);
+	}
+	if (nprocs < 1 || nprocs > MAXPROCS || nexecs < 1) {
+		errx(1, "Usage: execbench [nprocs (1-%d) [nexecs]]", MAXPROCS);
+	}
+
+	printf("execbench: %d processes, %d execs each\n", nprocs, nexecs);
+	__time(&startsecs, &startnsecs);
+
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			chain(nexecs);
+		}
+	}
+	for (i=0; i<nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
+		}
+	}
+
+	__time(&endsecs, &endnsecs);
+	nsecs = (unsigned long long)(endsecs - startsecs) * 1000000000ULL
+		+ endnsecs - startnsecs;
+	total = (unsigned long long)nprocs * nexecs;
+	if (nsecs == 0) {
+		nsecs = 1;
+	}
+
+	printf("%llu execs in %llu.%03llu s: %llu us per exec, "
+	       "%llu execs/s\n", total,
+	       nsecs / 1000000000ULL, (nsecs / 1000000ULL) % 1000,
+	       nsecs / total / 1000, total * 1000000000ULL / nsecs);
+	if (failed) {
+		errx(1, "%d workers failed", failed);
+	}
+	return 0;
+}
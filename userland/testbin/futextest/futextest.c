@@ -0,0 +1,193 @@
+/*
+ * futextest - user-level mutex and condition variable on futexes
+ * usage: futextest [nthreads [nloops]]
+ *
+ * Starts NTHREADS threads (default 4), each of which adds one to a
+ * shared counter NLOOPS times (default 10000) with a futex mutex
+ * held. The main thread waits on a futex condition variable until
+ * every worker has said it is done, then checks the total. The mutex
+ * only calls into the kernel when it finds the lock taken, so the
+ * number of futex_wait calls shows how often that happened.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define MAXTHREADS	32
+
+/* Compare-and-swap: store NEW at P if it holds OLD; returns what was there. */
+static
+int
+cas(volatile int *p, int old, int new)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		"1: ll %0, 0(%2);"
+		"bne %0, %3, 2f;"
+		"move %1, %4;"
+		"sc %1, 0(%2);"
+		"beqz %1, 1b;"
+		"2: .set pop"
+		: "=&r" (prev), "=&r" (tmp)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return prev;
+}
+
+/* Store NEW at P; returns what was there. */
+static
+int
+xchg(volatile int *p, int new)
+{
+	int prev;
+
+	do {
+		prev = *p;
+	} while (cas(p, prev, new) != prev);
+	return prev;
+}
+
+/* Add one to *P. */
+static
+void
+atomic_inc(volatile int *p)
+{
+	int prev;
+
+	do {
+		prev = *p;
+	} while (cas(p, prev, prev + 1) != prev);
+}
+
+/*
+ * Mutex: 0 unlocked, 1 locked, 2 locked and somebody may be asleep
+ * on it. Only the last case costs a system call to unlock.
+ */
+static volatile int nwaits;
+
+static
+void
+mutex_lock(volatile int *m)
+{
+	int c;
+
+	c = cas(m, 0, 1);
+	if (c == 0) {
+		return;
+	}
+	if (c != 2) {
+		c = xchg(m, 2);
+	}
+	while (c != 0) {
+		atomic_inc(&nwaits);
+		futex_wait(m, 2);
+		c = xchg(m, 2);
+	}
+}
+
+static
+void
+mutex_unlock(volatile int *m)
+{
+	if (xchg(m, 0) == 2) {
+		futex_wake(m, 1);
+	}
+}
+
+/*
+ * Condition variable: a sequence number bumped on every signal, so a
+ * signal between dropping the mutex and sleeping isn't lost. Both
+ * sides hold the mutex while they touch the sequence number.
+ */
+static
+void
+cond_wait(volatile int *c, volatile int *m)
+{
+	int seq = *c;
+
+	mutex_unlock(m);
+	futex_wait(c, seq);
+	mutex_lock(m);
+}
+
+static
+void
+cond_broadcast(volatile int *c)
+{
+	(*c)++;
+	futex_wake(c, MAXTHREADS);
+}
+
+static volatile int lock, done_cv;
+static volatile int counter, finished;
+static int nloops = 10000;
+
+static
+int
+worker(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < nloops; i++) {
+		mutex_lock(&lock);
+		counter++;
+		mutex_unlock(&lock);
+	}
+
+	mutex_lock(&lock);
+	finished++;
+	cond_broadcast(&done_cv);
+	mutex_unlock(&lock);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nthreads = 4;
+	int tids[MAXTHREADS];
+	int i, code;
+
+	if (argc > 1) {
+		nthreads = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nloops = atoi(argv[2]);
+	}
+	if (nthreads < 1 || nthreads > MAXTHREADS || nloops < 1) {
+		errx(1, "usage: futextest [nthreads [nloops]]");
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		tids[i] = thread_create(worker, NULL);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+
+	mutex_lock(&lock);
+	while (finished < nthreads) {
+		cond_wait(&done_cv, &lock);
+	}
+	mutex_unlock(&lock);
+
+	for (i = 0; i < nthreads; i++) {
+		if (thread_join(tids[i], &code) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	printf("futextest: %d threads, counter %d, %d futex waits\n",
+	       nthreads, counter, nwaits);
+	if (counter != nthreads * nloops) {
+		errx(1, "FAILED: expected %d", nthreads * nloops);
+	}
+	printf("futextest: passed\n");
+	return 0;
+}
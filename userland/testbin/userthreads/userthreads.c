@@ -32,17 +32,9 @@
  * forks 3 threads off 2 to functions, each of which displays a string
  * every once in a while.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * Threads are made with thread_create(), and a thread exits when it
+ * returns from the function it started in. Returning from main exits
+ * the whole process, so the parent joins its children first.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,6 +43,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
@@ -61,22 +54,30 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+int ThreadRunner(void *);
+int BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    int tids[NTHREADS];
+    int i, code;
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL);
+	if (tids[i] < 0)
+	    err(1, "thread_create");
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], &code) < 0)
+	    err(1, "thread_join");
     }
 
     tprintf("Parent has left.\n");
@@ -88,22 +89,26 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+int
+BladeRunner(void *unused)
 {
+    (void)unused;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    tprintf("Blade ");
 	count++;
     }
+    return 0;
 }
 
-void
-ThreadRunner()
+int
+ThreadRunner(void *unused)
 {
+    (void)unused;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    tprintf(" Runner\n");
 	count++;
     }
+    return 0;
 }